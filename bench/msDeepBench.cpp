@@ -0,0 +1,554 @@
+/**
+stand-in inputs, synthetic Deep scenes and a small runner for the checks and timings of the plugins, see bench/README.md
+**/
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <atomic>
+#include <sys/resource.h>
+#include "msDeepBench.h"
+
+
+
+static std::atomic<size_t> served_samples(0);
+
+
+size_t servedSamples()
+{
+	return served_samples;
+}
+
+
+void resetServedSamples()
+{
+	served_samples = 0;
+}
+
+
+DeepSource::DeepSource(const Box& box, const ChannelSet& channels, const Format& image_format) : DeepOnlyOp(0), format(image_format), channel_map(channels), version(0)
+{
+	formats.format(&format);
+	formats.fullSizeFormat(&format);
+	_deepInfo = DeepInfo(formats, box, channels);
+	pixels.resize((size_t)box.w() * box.h());
+}
+
+
+void DeepSource::setPixel(int y, int x, const std::vector<float>& samples)
+{
+	const Box& box = _deepInfo.box();
+	pixels[(size_t)(y - box.y()) * box.w() + x - box.x()] = samples;
+	version++;
+}
+
+
+const std::vector<float>& DeepSource::storedPixel(int y, int x) const
+{
+	const Box& box = _deepInfo.box();
+	return pixels[(size_t)(y - box.y()) * box.w() + x - box.x()];
+}
+
+
+bool DeepSource::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+	const Box& bbox = _deepInfo.box();
+	size_t in_size = channel_map.size();
+	size_t served = 0;
+	DeepOutPixel outPixel;
+	outPlane = DeepOutputPlane(channels, box);
+
+	for (Box::iterator it = box.begin(); it != box.end(); ++it)
+	{
+		if ((it.x < bbox.x()) || (it.x >= bbox.r()) || (it.y < bbox.y()) || (it.y >= bbox.t()))
+		{
+			outPlane.addHole();
+			continue;
+		}
+
+		const std::vector<float>& samples = storedPixel(it.y, it.x);
+		outPixel.clear();
+
+		//requested channels the source doesn't have are 0
+		for (size_t s = 0; s < samples.size() / in_size; s++)
+			foreach (z, channels)
+				outPixel.push_back(channel_map.contains(z) ? samples[s * in_size + channel_map.chanNo(z)] : 0.0f);
+
+		served += samples.size() / in_size;
+		outPlane.addPixel(outPixel);
+	}
+
+	served_samples += served;
+	return true;
+}
+
+
+void FunctionSource::engine(int y, int x, int r, ChannelMask channels, Row& row)
+{
+	foreach (z, channels)
+	{
+		float* values = row.writable(z);
+
+		for (int i = x; i < r; i++)
+			values[i] = function(i, y);
+	}
+}
+
+
+ChannelSet rgbaDeep()
+{
+	ChannelSet channels(Mask_RGBA);
+	channels += Mask_Deep;
+	return channels;
+}
+
+
+DeepSource* makeScene(DeepScene scene, int width, int height, unsigned seed)
+{
+	ChannelSet channels = rgbaDeep();
+	DeepSource* source = new DeepSource(Box(0, 0, width, height), channels, Format(width, height));
+
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<float> uniform(0, 1);
+
+	int max_samples = (scene == hard_surface) ? 1 : (scene == hair) ? 40 : 16;
+	float transparent = (scene == hair) ? 0.05f : 0.0f;					//share of samples with alpha 0
+	float opaque = (scene == hard_surface) ? 1.0f : (scene == hair) ? 0.02f : 0.0f;
+	float same_depth = (scene == hair) ? 0.02f : 0.0f;					//share of samples at the same depth as the previous one
+	bool volumetric = scene == fog;
+
+	std::vector<float> samples;
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			int count = random() % (max_samples + 1);
+			float previous_front = 1;
+			samples.clear();
+
+			for (int k = 0; k < count; k++)
+			{
+				float alpha = uniform(random);
+				float kind = uniform(random);
+
+				if (kind < transparent)
+					alpha = 0;
+				else if (kind < transparent + opaque)
+					alpha = 1;
+
+				float front = (uniform(random) < same_depth) ? previous_front : uniform(random) * 10 + 1;
+				float back = (volumetric && (uniform(random) < 0.5f)) ? front + uniform(random) : front;
+				previous_front = front;
+
+				foreach (z, channels)
+				{
+					if (z == Chan_Alpha)
+						samples.push_back(alpha);
+					else if (z == Chan_DeepFront)
+						samples.push_back(front);
+					else if (z == Chan_DeepBack)
+						samples.push_back(back);
+					else
+						samples.push_back(uniform(random) * alpha);				//premultiplied color
+				}
+			}
+
+			source->setPixel(y, x, samples);
+		}
+	}
+
+	return source;
+}
+
+
+Op* createPlugin(const char* name)
+{
+	Op* op = Op::Description::create(name);
+
+	if (!op)
+	{
+		fprintf(stderr, "%s is not linked into this executable\n", name);
+		abort();
+	}
+
+	op->knob("");					//creates the knobs
+	return op;
+}
+
+
+DeepOp* deepOp(Op* op)
+{
+	DeepOp* deep = dynamic_cast<DeepOp*>(op);
+
+	if (!deep)
+	{
+		fprintf(stderr, "%s is no Deep op\n", op->Class());
+		abort();
+	}
+
+	return deep;
+}
+
+
+static Knob* findKnob(Op* op, const char* name)
+{
+	Knob* k = op->knob(name);
+
+	if (!k)
+	{
+		fprintf(stderr, "%s has no knob %s\n", op->Class(), name);
+		abort();
+	}
+
+	return k;
+}
+
+
+void setKnob(Op* op, const char* name, double value)
+{
+	Knob* k = findKnob(op, name);
+
+	for (int i = 0; i < k->count(); i++)
+		k->set_value(value, i);
+}
+
+
+void setFormatKnob(Op* op, const char* name, const Format* format)
+{
+	FormatPair formats;
+	formats.format(format);
+	formats.fullSizeFormat(format);
+	findKnob(op, name)->set_format(formats);
+}
+
+
+void pressKnob(Op* op, const char* name)
+{
+	op->knob_changed(findKnob(op, name));
+}
+
+
+double statValue(Op* op, const char* name)
+{
+	pressKnob(op, "update_stats");
+	std::string text = findKnob(op, "stats_text")->get_text();
+	std::string key = std::string(name) + ": ";
+	size_t line = 0;
+
+	while (text.compare(line, key.size(), key) != 0)
+	{
+		line = text.find('\n', line);
+		if (line == std::string::npos)
+		{
+			fprintf(stderr, "%s has no stat %s\n", op->Class(), name);
+			abort();
+		}
+
+		line++;
+	}
+
+	return atof(text.c_str() + line + key.size());
+}
+
+
+DeepPlane render(Op* op, const Box& box, const ChannelSet& channels)
+{
+	DeepOp* deep = deepOp(op);
+	std::vector<RequestData> requests;
+	DeepPlane plane;
+
+	op->validate(true);
+	deep->getDeepRequests(box, channels, 1, requests);
+
+	if (!deep->deepEngine(box, channels, plane))
+	{
+		fprintf(stderr, "%s failed to render\n", op->Class());
+		abort();
+	}
+
+	return plane;
+}
+
+
+DeepPlane renderTiled(Op* op, const Box& box, const ChannelSet& channels, int tile_width, int tile_height)
+{
+	size_t channel_count = ChannelMap(channels).size();
+	std::vector<DeepOutPixel> pixels((size_t)box.w() * box.h());
+
+	for (int y = box.y(); y < box.t(); y += tile_height)
+	{
+		for (int x = box.x(); x < box.r(); x += tile_width)
+		{
+			Box tile(x, y, std::min(x + tile_width, box.r()), std::min(y + tile_height, box.t()));
+			DeepPlane plane = render(op, tile, channels);
+
+			for (Box::iterator it = tile.begin(); it != tile.end(); ++it)
+			{
+				DeepPixel pixel = plane.getPixel(it);
+				pixels[(size_t)(it.y - box.y()) * box.w() + it.x - box.x()].assign(pixel.data(), pixel.data() + pixel.getSampleCount() * channel_count);
+			}
+		}
+	}
+
+	DeepOutputPlane outPlane(channels, box);
+
+	for (size_t i = 0; i < pixels.size(); i++)
+		outPlane.addPixel(pixels[i]);
+
+	return DeepPlane(outPlane);
+}
+
+
+bool identical(const DeepPlane& a, const DeepPlane& b)
+{
+	const Box& box = a.box();
+
+	if ((box.x() != b.box().x()) || (box.y() != b.box().y()) || (box.r() != b.box().r()) || (box.t() != b.box().t()) || (a.channels() != b.channels()))
+		return false;
+
+	for (Box::iterator it = box.begin(); it != box.end(); ++it)
+		if (!identical(a.getPixel(it), b.getPixel(it)))
+			return false;
+
+	return true;
+}
+
+
+bool identical(const DeepPixel& a, const DeepPixel& b)
+{
+	size_t channel_count = a.channels().size();
+
+	if ((a.getSampleCount() != b.getSampleCount()) || (b.channels().size() != channel_count))
+		return false;
+
+	return !a.getSampleCount() || !memcmp(a.data(), b.data(), a.getSampleCount() * channel_count * sizeof(float));
+}
+
+
+bool sameChannels(const DeepPlane& part, const DeepPlane& full)
+{
+	for (Box::iterator it = part.box().begin(); it != part.box().end(); ++it)
+	{
+		DeepPixel pixel = part.getPixel(it);
+		DeepPixel full_pixel = full.getPixel(it);
+
+		if (pixel.getSampleCount() != full_pixel.getSampleCount())
+			return false;
+
+		for (size_t s = 0; s < pixel.getSampleCount(); s++)
+			foreach (z, part.channels())
+				if (pixel.getUnorderedSample(s, z) != full_pixel.getUnorderedSample(s, z))
+					return false;
+	}
+
+	return true;
+}
+
+
+void flatten(const DeepPixel& pixel, float rgba[4])
+{
+	static const Channel channels[4] = {Chan_Red, Chan_Green, Chan_Blue, Chan_Alpha};
+
+	for (int c = 0; c < 4; c++)
+		rgba[c] = 0;
+
+	for (size_t s = pixel.getSampleCount(); s-- > 0;)
+	{
+		float transmission = 1 - rgba[3];
+
+		for (int c = 0; c < 4; c++)
+			rgba[c] += pixel.getOrderedSample(s, channels[c]) * transmission;
+	}
+}
+
+
+float flatDifference(const DeepPlane& a, const DeepPlane& b)
+{
+	float difference = 0;
+
+	for (Box::iterator it = a.box().begin(); it != a.box().end(); ++it)
+	{
+		float flat_a[4], flat_b[4];
+		flatten(a.getPixel(it), flat_a);
+		flatten(b.getPixel(it), flat_b);
+
+		for (int c = 0; c < 4; c++)
+			difference = std::max(difference, std::fabs(flat_a[c] - flat_b[c]));
+	}
+
+	return difference;
+}
+
+
+float sumDifference(const DeepPlane& a, const DeepPlane& b)
+{
+	static const Channel channels[4] = {Chan_Red, Chan_Green, Chan_Blue, Chan_Alpha};
+	float difference = 0;
+
+	for (Box::iterator it = a.box().begin(); it != a.box().end(); ++it)
+	{
+		DeepPixel pa = a.getPixel(it);
+		DeepPixel pb = b.getPixel(it);
+
+		for (int c = 0; c < 4; c++)
+		{
+			float sum_a = 0, sum_b = 0;
+
+			for (size_t s = 0; s < pa.getSampleCount(); s++)
+				sum_a += pa.getUnorderedSample(s, channels[c]);
+
+			for (size_t s = 0; s < pb.getSampleCount(); s++)
+				sum_b += pb.getUnorderedSample(s, channels[c]);
+
+			difference = std::max(difference, std::fabs(sum_a - sum_b));
+		}
+	}
+
+	return difference;
+}
+
+
+size_t sampleCount(const DeepPlane& plane)
+{
+	size_t count = 0;
+
+	for (Box::iterator it = plane.box().begin(); it != plane.box().end(); ++it)
+		count += plane.getPixel(it).getSampleCount();
+
+	return count;
+}
+
+
+static int failures = 0;
+
+
+void benchCheck(bool passed, const char* condition, const char* file, int line)
+{
+	if (passed)
+		return;
+
+	fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+	failures++;
+}
+
+
+double bestTime(const std::function<void()>& work, int repeats)
+{
+	double best = 0;
+
+	for (int i = 0; i < repeats; i++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		work();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if ((i == 0) || (seconds < best))
+			best = seconds;
+	}
+
+	return best;
+}
+
+
+//on Linux, the peak resident memory of the process (VmHWM) can be reset, so each timing gets its own peak; elsewhere, it is the peak of the whole run
+static void resetPeakMemory()
+{
+	FILE* file = fopen("/proc/self/clear_refs", "w");
+
+	if (file)
+	{
+		fputs("5", file);
+		fclose(file);
+	}
+}
+
+
+static size_t peakMemory()
+{
+	FILE* file = fopen("/proc/self/status", "r");
+	char line[256];
+
+	while (file && fgets(line, sizeof(line), file))
+	{
+		size_t kilobytes;
+
+		if (sscanf(line, "VmHWM: %zu kB", &kilobytes) == 1)
+		{
+			fclose(file);
+			return kilobytes << 10;
+		}
+	}
+
+	if (file)
+		fclose(file);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (size_t)usage.ru_maxrss << 10;
+}
+
+
+void printTiming(const char* label, double seconds, size_t input_samples, size_t output_samples)
+{
+	printf("%-32s %8.3f s %9.2f M samples/s   in %10zu   out %10zu (x%.2f)   peak %8.1f MB\n", label, seconds, (seconds > 0) ? input_samples / seconds * 1e-6 : 0.0,
+		input_samples, output_samples, input_samples ? (double)output_samples / input_samples : 0.0, peakMemory() / 1048576.0);
+	fflush(stdout);
+
+	resetPeakMemory();
+}
+
+
+void timeRender(const char* label, Op* op, const Box& box, const ChannelSet& channels)
+{
+	resetServedSamples();
+	size_t output_samples = sampleCount(render(op, box, channels));
+	size_t input_samples = servedSamples();
+
+	printTiming(label, bestTime([&]() {render(op, box, channels);}), input_samples, output_samples);
+}
+
+
+int runBench(int argc, char** argv, const std::vector<BenchCase>& checks, const std::vector<BenchCase>& timings)
+{
+	bool time = false;
+	std::vector<std::string> filters;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--time"))
+			time = true;
+		else
+			filters.push_back(argv[i]);
+	}
+
+	const std::vector<BenchCase>& cases = time ? timings : checks;
+
+	if (time)
+		resetPeakMemory();
+
+	for (size_t i = 0; i < cases.size(); i++)
+	{
+		bool selected = filters.empty();
+
+		for (size_t f = 0; f < filters.size(); f++)
+			selected |= std::string(cases[i].name).find(filters[f]) != std::string::npos;
+
+		if (!selected)
+			continue;
+
+		int failed_before = failures;
+		cases[i].run();
+
+		if (!time)
+			printf("%-50s %s\n", cases[i].name, (failures == failed_before) ? "ok" : "FAILED");
+	}
+
+	if (failures)
+		printf("%d checks failed\n", failures);
+
+	return failures ? 1 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,133 @@
+/**
+stand-in inputs, synthetic Deep scenes and a small runner for the checks and timings of the plugins, see bench/README.md
+**/
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "DDImage/DeepOp.h"
+#include "DDImage/Iop.h"
+
+
+
+using namespace DD::Image;
+
+
+
+//a Deep input that holds its pixels in memory; pixels outside its box are empty
+class DeepSource : public DeepOnlyOp
+{
+	private:
+		Format format;
+		FormatPair formats;
+		ChannelMap channel_map;
+		std::vector<std::vector<float> > pixels;		//all channels of each sample back to back, in the order they were set
+		unsigned version;
+
+	public:
+		DeepSource(const Box& box, const ChannelSet& channels, const Format& image_format);
+
+		//replaces the samples of a pixel, given with all channels of the source back to back
+		void setPixel(int y, int x, const std::vector<float>& samples);
+		const std::vector<float>& storedPixel(int y, int x) const;
+
+		//counts the samples it hands out, see servedSamples
+		bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane);
+		void append(Hash& hash) {hash.append(version);}
+
+		const char* Class() const {return "DeepSource";}
+		Op* op() {return this;}
+};
+
+
+//a flat input whose value at each pixel is given by a function, e.g. a keymix mask
+class FunctionSource : public Iop
+{
+	private:
+		std::function<float(int, int)> function;
+		unsigned version;
+
+	public:
+		FunctionSource(const std::function<float(int, int)>& f) : Iop(0), function(f), version(0) {}
+
+		void set(const std::function<float(int, int)>& f) {function = f; version++;}
+		void engine(int y, int x, int r, ChannelMask channels, Row& row);
+		void append(Hash& hash) {hash.append(version);}
+
+		const char* Class() const {return "FunctionSource";}
+};
+
+
+//samples handed out by all DeepSources since the last reset, i.e. how much the ops read from their inputs
+size_t servedSamples();
+void resetServedSamples();
+
+
+//hard surface: at most one opaque sample per pixel; hair: up to 40 thin, mostly semi-transparent samples, some of them at the same depth; fog: up to 16 overlapping volumetric samples
+enum DeepScene {hard_surface, hair, fog};
+
+ChannelSet rgbaDeep();
+DeepSource* makeScene(DeepScene scene, int width, int height, unsigned seed);
+
+
+//creates a plugin registered with Op::Description, with its knobs created so they can be set by name
+Op* createPlugin(const char* name);
+DeepOp* deepOp(Op* op);
+
+//sets all values of a knob, e.g. both the width and height of a blur size
+void setKnob(Op* op, const char* name, double value);
+void setFormatKnob(Op* op, const char* name, const Format* format);
+
+//presses a button knob, e.g. "reset_stats"
+void pressKnob(Op* op, const char* name);
+
+//one of the stats an op shows after pressing "update_stats", e.g. "allocations"
+double statValue(Op* op, const char* name);
+
+//validates the op and renders a box of it, the same way a downstream op would
+DeepPlane render(Op* op, const Box& box, const ChannelSet& channels);
+
+//renders a box as tiles of at most tile_width x tile_height pixels and puts them together
+DeepPlane renderTiled(Op* op, const Box& box, const ChannelSet& channels, int tile_width, int tile_height);
+
+//same box, channels and stored samples, bit for bit
+bool identical(const DeepPlane& a, const DeepPlane& b);
+bool identical(const DeepPixel& a, const DeepPixel& b);
+
+//the requested channels of each sample of "part" are the same as in "full", a request for all channels
+bool sameChannels(const DeepPlane& part, const DeepPlane& full);
+
+//largest difference of the flattened rgba of two planes of the same box
+float flatDifference(const DeepPlane& a, const DeepPlane& b);
+
+//composites the samples of a pixel over each other from the closest to the furthest
+void flatten(const DeepPixel& pixel, float rgba[4]);
+
+//largest difference of the sums of all samples of a pixel, per rgba channel; unlike flattening, it doesn't depend on the order of samples at the same depth
+float sumDifference(const DeepPlane& a, const DeepPlane& b);
+
+size_t sampleCount(const DeepPlane& plane);
+
+
+//a named check or timing; checks report failures through CHECK
+struct BenchCase
+{
+	const char* name;
+	std::function<void()> run;
+};
+
+#define CHECK(condition) benchCheck((condition), #condition, __FILE__, __LINE__)
+void benchCheck(bool passed, const char* condition, const char* file, int line);
+
+//best wall-clock time of "repeats" runs, in seconds
+double bestTime(const std::function<void()>& work, int repeats = 3);
+
+//prints a timing with the samples read from the inputs and written to the output, the input samples per second and the peak resident memory since the last timing
+void printTiming(const char* label, double seconds, size_t input_samples, size_t output_samples);
+
+//times rendering a box of the op and prints it with printTiming
+void timeRender(const char* label, Op* op, const Box& box, const ChannelSet& channels);
+
+//runs all checks, or with --time all timings; further arguments only run the cases whose name contains one of them
+int runBench(int argc, char** argv, const std::vector<BenchCase>& checks, const std::vector<BenchCase>& timings);
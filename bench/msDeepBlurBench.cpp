@@ -0,0 +1,202 @@
+/**
+checks and timings of msDeepBlur, see bench/README.md
+**/
+
+#include <cstdio>
+#include "msDeepBench.h"
+
+
+
+static const char* mode_names[] = {"exact", "separable", "sliding window", "fast blur", 0};
+
+
+//a blur of the given mode; mode 3 is the fast blur
+static Op* blur(DeepSource* source, int mode, float size)
+{
+	Op* op = createPlugin("msDeepBlur");
+	op->set_input(0, source);
+	setKnob(op, "size", size);
+	setKnob(op, "mode", (mode == 3) ? 0 : mode);
+	setKnob(op, "fast_blur", mode == 3);
+	return op;
+}
+
+
+//the merge settings that take the most code paths
+static void reduce(Op* op)
+{
+	setKnob(op, "opacity_cutoff", 0.995);
+	setKnob(op, "consolidate", true);
+	setKnob(op, "max_samples", 3);
+}
+
+
+static void checkThreads()
+{
+	DeepSource* source = makeScene(hair, 40, 24, 1);
+	Box box(2, 2, 38, 22);
+
+	for (int mode = 0; mode < 4; mode++)
+	{
+		Op* op = blur(source, mode, 4);
+		setKnob(op, "max_threads", 1);
+		DeepPlane single = render(op, box, rgbaDeep());
+		setKnob(op, "max_threads", 4);
+		CHECK(identical(single, render(op, box, rgbaDeep())));
+
+		reduce(op);
+		setKnob(op, "max_threads", 1);
+		single = render(op, box, rgbaDeep());
+		setKnob(op, "max_threads", 4);
+		CHECK(identical(single, render(op, box, rgbaDeep())));
+	}
+}
+
+
+static void checkTiles()
+{
+	DeepSource* source = makeScene(hair, 40, 24, 2);
+	Box box(0, 0, 40, 24);
+
+	for (int mode = 0; mode < 3; mode++)
+	{
+		Op* op = blur(source, mode, 5);
+		CHECK(identical(render(op, box, rgbaDeep()), renderTiled(op, box, rgbaDeep(), 16, 8)));
+
+		reduce(op);
+		CHECK(identical(render(op, box, rgbaDeep()), renderTiled(op, box, rgbaDeep(), 16, 8)));
+	}
+
+	//the fast blur slices the same in every tile with either slicing
+	for (int slicing = 0; slicing < 2; slicing++)
+	{
+		Op* op = blur(source, 3, 5);
+		setKnob(op, "slicing", slicing);
+		setKnob(op, "slice_near", 1);
+		setKnob(op, "slice_far", 11);
+		CHECK(identical(render(op, box, rgbaDeep()), renderTiled(op, box, rgbaDeep(), 16, 8)));
+	}
+}
+
+
+static void checkCache()
+{
+	DeepSource* source = makeScene(hair, 32, 16, 3);
+	Box box(4, 4, 28, 12);
+
+	for (int mode = 0; mode < 4; mode++)
+	{
+		Op* op = blur(source, mode, 3);
+		DeepPlane uncached = render(op, box, rgbaDeep());
+
+		setKnob(op, "cache_memory", 64);
+		CHECK(identical(uncached, render(op, box, rgbaDeep())));
+		CHECK(identical(uncached, render(op, box, rgbaDeep())));			//from the cache
+
+		//a changed input must not be served from the cache
+		std::vector<float> samples(source->storedPixel(8, 8));
+		source->setPixel(8, 8, std::vector<float>());
+		Op* reference = blur(source, mode, 3);
+		CHECK(identical(render(reference, box, rgbaDeep()), render(op, box, rgbaDeep())));
+		source->setPixel(8, 8, samples);
+	}
+}
+
+
+//once a box has been rendered, the scratch memory and output pixels are large enough to render it again without allocating
+static void checkWarm()
+{
+	DeepSource* source = makeScene(hair, 32, 16, 4);
+	Box box(4, 4, 28, 12);
+
+	for (int mode = 0; mode < 4; mode++)
+	{
+		Op* op = blur(source, mode, 3);
+		reduce(op);
+		render(op, box, rgbaDeep());
+
+		pressKnob(op, "reset_stats");
+		render(op, box, rgbaDeep());
+		CHECK(statValue(op, "boxes") == 1);
+		CHECK(statValue(op, "allocations") == 0);
+	}
+}
+
+
+//without dropping or reducing samples, all modes keep the same samples with the same total weight;
+//samples of different pixels at the same depth may be merged in another order, which shifts alpha and color between them, so hair is left out
+static void checkModes()
+{
+	DeepScene scenes[] = {hard_surface, fog};
+
+	for (int s = 0; s < 2; s++)
+	{
+		DeepSource* source = makeScene(scenes[s], 24, 16, 5);
+		Box box(0, 0, 24, 16);
+		Op* exact = blur(source, 0, 3);
+		setKnob(exact, "drop_hidden", false);
+		setKnob(exact, "drop_transparent", false);
+		DeepPlane reference = render(exact, box, rgbaDeep());
+
+		for (int mode = 1; mode < 3; mode++)
+		{
+			Op* op = blur(source, mode, 3);
+			setKnob(op, "drop_hidden", false);
+			setKnob(op, "drop_transparent", false);
+			DeepPlane plane = render(op, box, rgbaDeep());
+			CHECK(sampleCount(plane) == sampleCount(reference));
+			CHECK(sumDifference(plane, reference) < 1e-4f);
+		}
+	}
+}
+
+
+//depth and alpha drive the merge, so they are needed even if only colors are requested
+static void checkChannels()
+{
+	DeepSource* source = makeScene(hair, 32, 16, 6);
+	Box box(0, 0, 32, 16);
+	for (int mode = 0; mode < 4; mode++)
+	{
+		Op* op = blur(source, mode, 3);
+		CHECK(sameChannels(render(op, box, Mask_RGB), render(op, box, rgbaDeep())));
+	}
+}
+
+
+static void timeModes()
+{
+	DeepScene scenes[] = {hard_surface, hair, fog};
+	const char* scene_names[] = {"hard surface", "hair", "fog"};
+
+	for (int s = 0; s < 3; s++)
+	{
+		DeepSource* source = makeScene(scenes[s], 64, 64, 6);
+		Box box(0, 0, 64, 64);
+
+		for (int mode = 0; mode < 4; mode++)
+		{
+			std::string label = std::string(scene_names[s]) + ", " + mode_names[mode];
+			timeRender(label.c_str(), blur(source, mode, 5), box, rgbaDeep());
+		}
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	std::vector<BenchCase> checks = {
+		{"threads give the same result", checkThreads},
+		{"tiles give the same result", checkTiles},
+		{"cache gives the same result", checkCache},
+		{"a box rendered again doesn't allocate", checkWarm},
+		{"modes merge the same samples", checkModes},
+		{"colors are merged by depth and alpha", checkChannels}
+	};
+
+	std::vector<BenchCase> timings = {
+		{"modes", timeModes}
+	};
+
+	return runBench(argc, argv, checks, timings);
+}
\ No newline at end of file
@@ -0,0 +1,282 @@
+/**
+checks and timings of msDeepFunctions.h: mergeDeepSamples against the merge as it was first written (combineDeepPixels of msDeepFunctions v1.0.0), and the scratch memory, see bench/README.md
+**/
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include "msDeepBench.h"
+#include "msDeepFunctions.h"
+
+
+
+//the original merge, kept as the reference: every optimization of the merge has to give the same result bit for bit
+static void referenceMerge(std::vector<DeepPixel>& inPixels, DeepOutPixel& outPixel, const ChannelSet& channels, int amount, const float weight[], bool drop_hidden, bool drop_transparent, float transparency_threshold)
+{
+	std::vector<size_t> sampleCount(amount);
+	std::vector<size_t> sampleNo(amount);
+	std::vector<float> distance(amount);
+	std::vector<float> alpha(amount);
+	std::vector<float> alpha_accum(amount);
+	float alpha_accum_combined = 0;
+	float designated_alpha_accum = 0;
+
+	for (int i = 0; i < amount; i++)
+	{
+		sampleCount[i] = inPixels[i].getSampleCount();
+		sampleNo[i] = 0;
+
+		if (sampleCount[i] > 0)
+			distance[i] = inPixels[i].getOrderedSample(sampleCount[i] - 1, Chan_DeepFront);
+		else
+			distance[i] = FLT_MAX;
+
+		alpha[i] = 0;
+		alpha_accum[i] = 0;
+	}
+
+	while (std::accumulate(sampleNo.begin(), sampleNo.end(), 0) < std::accumulate(sampleCount.begin(), sampleCount.end(), 0))
+	{
+		int a = std::distance(distance.begin(), std::min_element(distance.begin(), distance.end()));
+		int inverted_sampleCount = sampleCount[a] - 1 - sampleNo[a];
+		alpha[a] = inPixels[a].getOrderedSample(inverted_sampleCount, Chan_Alpha);
+
+		if (!((alpha[a] <= transparency_threshold) && drop_transparent))
+		{
+			if (alpha[a] == 0)
+			{
+				foreach (z, channels)
+					outPixel.push_back(inPixels[a].channels().contains(z) ? inPixels[a].getOrderedSample(inverted_sampleCount, z) : 0);
+			}
+
+			else
+			{
+				designated_alpha_accum -= alpha_accum[a] * weight[a];
+				alpha_accum[a] += alpha[a] * (1 - alpha_accum[a]);
+				designated_alpha_accum += alpha_accum[a] * weight[a];
+
+				float new_alpha;
+				if (designated_alpha_accum < 1)
+					new_alpha = (designated_alpha_accum - alpha_accum_combined) / (1 - alpha_accum_combined);
+				else
+					new_alpha = alpha[a];
+
+				alpha_accum_combined += new_alpha * (1 - alpha_accum_combined);
+
+				if (!((new_alpha <= transparency_threshold) && drop_transparent))
+				{
+					float new_alpha_factor = new_alpha / alpha[a];
+
+					foreach (z, channels)
+					{
+						if ((z == Chan_DeepFront) || (z == Chan_DeepBack))
+							outPixel.push_back(inPixels[a].getOrderedSample(inverted_sampleCount, z));
+						else
+							outPixel.push_back(inPixels[a].channels().contains(z) ? inPixels[a].getOrderedSample(inverted_sampleCount, z) * new_alpha_factor : 0);
+					}
+
+					if ((new_alpha == 1) && drop_hidden)
+						return;
+				}
+			}
+		}
+
+		sampleNo[a]++;
+
+		if (sampleNo[a] < sampleCount[a])
+			distance[a] = inPixels[a].getOrderedSample(inverted_sampleCount - 1, Chan_DeepFront);
+		else
+			distance[a] = FLT_MAX;
+	}
+}
+
+
+static bool sameValues(const DeepOutPixel& a, const DeepOutPixel& b)
+{
+	return (a.size() == b.size()) && (a.empty() || !memcmp(&a[0], &b[0], a.size() * sizeof(float)));
+}
+
+
+//footprints of random pixels with random weights, merged through combineDeepPixels, through one DeepPixelSource for all footprints, as the ops do, and from the gathered samples of the plane
+static void checkFanIn(DeepScene scene)
+{
+	const int size = 12;
+	ChannelSet channels = rgbaDeep();
+	DeepPlane plane = render(makeScene(scene, size, size, 1), Box(0, 0, size, size), channels);
+
+	DeepSampleArena arena;
+	DeepCounters counters;
+	gatherDeepSamples(plane, channels, arena, counters);
+
+	std::mt19937 random(2);
+	std::uniform_real_distribution<float> uniform(0, 1);
+	const int amounts[] = {1, 2, 3, 9, 25, 40};
+	bool same = true;
+
+	for (int a = 0; a < 6; a++)
+	{
+		int amount = amounts[a];
+		std::vector<DeepPixel> pixels;
+		std::vector<size_t> positions(amount);
+		std::vector<float> weight(amount);
+		DeepPixelSource pixel_source(channels);
+		DeepArenaSource arena_source(arena);
+		arena_source.pixels = &positions[0];
+
+		for (int footprint = 0; footprint < 50; footprint++)
+		{
+			pixels.clear();
+			pixel_source.clear();
+			float total = 0;
+
+			for (int i = 0; i < amount; i++)
+			{
+				int x = random() % size;
+				int y = random() % size;
+				pixels.push_back(plane.getPixel(y, x));
+				pixel_source.push_back(plane.getPixel(y, x));
+				positions[i] = arena.pixel(y, x);
+				weight[i] = uniform(random);
+				total += weight[i];
+			}
+
+			for (int i = 0; i < amount; i++)
+				weight[i] /= total;
+
+			for (int flags = 0; flags < 8; flags++)
+			{
+				bool drop_hidden = flags & 1;
+				bool drop_transparent = flags & 2;
+				float threshold = (flags & 4) ? 0.05f : 0;
+
+				DeepOutPixel reference, combined, from_pixels, from_arena;
+				referenceMerge(pixels, reference, channels, amount, &weight[0], drop_hidden, drop_transparent, threshold);
+				combineDeepPixels(pixels, combined, channels, amount, &weight[0], drop_hidden, drop_transparent, threshold);
+				mergeDeepSamples(pixel_source, from_pixels, channels, amount, &weight[0], drop_hidden, drop_transparent, threshold);
+				mergeDeepSamples(arena_source, from_arena, channels, amount, &weight[0], drop_hidden, drop_transparent, threshold);
+
+				same &= sameValues(reference, combined) && sameValues(reference, from_pixels) && sameValues(reference, from_arena);
+			}
+		}
+	}
+
+	CHECK(same);
+}
+
+
+//a box that needs more than scratch_memory_kept gives it back afterwards and the stats count that; smaller boxes keep their scratch memory
+static void checkRelease()
+{
+	DeepStats stats;
+	ChannelSet channels = rgbaDeep();
+	DeepScratch& scratch = threadScratch();
+	size_t arena_size = 0;
+
+	auto render = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
+	{
+		resizeScratch(threadScratch().arena.data, arena_size, threadScratch().counters.allocations);
+
+		for (int y = y_begin; y < y_end; y++)
+			for (int x = 0; x < 16; x++)
+				(outPixels++)->clear();
+	};
+
+	for (int box_size = 0; box_size < 2; box_size++)
+	{
+		arena_size = box_size ? scratch_memory_kept / sizeof(float) + 1 : 1024;
+		DeepOutputPlane outPlane(channels, Box(0, 0, 16, 16));
+		DeepStatsScope scope(stats, channels);
+		renderDeepRows(Box(0, 0, 16, 16), 1, render, outPlane);
+	}
+
+	CHECK(stats.counters.releases == 1);
+	CHECK(scratch.arena.data.capacity() == 0);
+
+	//the small box keeps its memory
+	DeepOutputPlane outPlane(channels, Box(0, 0, 16, 16));
+	arena_size = 1024;
+	renderDeepRows(Box(0, 0, 16, 16), 1, render, outPlane);
+	CHECK(scratch.arena.data.capacity() >= 1024);
+	CHECK(scratch.counters.releases == 1);
+}
+
+
+//merges each run of "amount" consecutive pixels of a hair plate, with the reference and with mergeDeepSamples
+static void timeFanIn()
+{
+	const int size = 64;
+	ChannelSet channels = rgbaDeep();
+	size_t channel_count = ChannelMap(channels).size();
+	DeepPlane plane = render(makeScene(hair, size, size, 3), Box(0, 0, size, size), channels);
+	const int amounts[] = {2, 9, 25, 49};
+
+	for (int a = 0; a < 4; a++)
+	{
+		int amount = amounts[a];
+		std::vector<float> weight(amount, 1.0f / amount);
+		std::vector<DeepPixel> pixels;
+		DeepPixelSource source(channels);
+		DeepOutPixel outPixel;
+		size_t input_samples = 0;
+		size_t output_samples = 0;
+
+		double reference = bestTime([&]()
+		{
+			input_samples = output_samples = 0;
+
+			for (int p = 0; p + amount <= size * size; p++)
+			{
+				pixels.clear();
+				for (int i = 0; i < amount; i++)
+				{
+					pixels.push_back(plane.getPixel((p + i) / size, (p + i) % size));
+					input_samples += pixels.back().getSampleCount();
+				}
+
+				outPixel.clear();
+				referenceMerge(pixels, outPixel, channels, amount, &weight[0], true, true, 0);
+				output_samples += outPixel.size() / channel_count;
+			}
+		});
+
+		char label[64];
+		snprintf(label, sizeof(label), "%d pixels, reference", amount);
+		printTiming(label, reference, input_samples, output_samples);
+
+		double merge = bestTime([&]()
+		{
+			output_samples = 0;
+
+			for (int p = 0; p + amount <= size * size; p++)
+			{
+				source.clear();
+				for (int i = 0; i < amount; i++)
+					source.push_back(plane.getPixel((p + i) / size, (p + i) % size));
+
+				outPixel.clear();
+				mergeDeepSamples(source, outPixel, channels, amount, &weight[0], true, true, 0);
+				output_samples += outPixel.size() / channel_count;
+			}
+		});
+
+		snprintf(label, sizeof(label), "%d pixels, mergeDeepSamples", amount);
+		printTiming(label, merge, input_samples, output_samples);
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	std::vector<BenchCase> checks = {
+		{"hard surface merges like the reference", []() {checkFanIn(hard_surface);}},
+		{"hair merges like the reference", []() {checkFanIn(hair);}},
+		{"fog merges like the reference", []() {checkFanIn(fog);}},
+		{"large boxes release their scratch memory", checkRelease}
+	};
+
+	std::vector<BenchCase> timings = {
+		{"fan-in", timeFanIn}
+	};
+
+	return runBench(argc, argv, checks, timings);
+}
\ No newline at end of file
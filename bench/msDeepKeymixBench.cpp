@@ -0,0 +1,116 @@
+/**
+checks and timings of msDeepKeymix, see bench/README.md
+**/
+
+#include <cmath>
+#include <cstdio>
+#include "msDeepBench.h"
+
+
+
+//B, A and a mask that is 0 on the left, 1 on the right and a ramp in between
+static Op* keymix(DeepSource* b, DeepSource* a, FunctionSource* mask)
+{
+	Op* op = createPlugin("msDeepKeymix");
+	op->set_input(0, b);
+	op->set_input(1, a);
+	op->set_input(2, mask);
+	return op;
+}
+
+
+static FunctionSource* ramp(int width)
+{
+	return new FunctionSource([=](int x, int) {return (x - width / 3) / (width / 3.0f);});
+}
+
+
+static void checkPipeThrough()
+{
+	int width = 48;
+	DeepSource* b = makeScene(hair, width, 16, 1);
+	DeepSource* a = makeScene(fog, width, 16, 2);
+	Op* op = keymix(b, a, ramp(width));
+
+	Box box(0, 0, width, 16);
+	DeepPlane output = render(op, box, rgbaDeep());
+	DeepPlane plane_b = render(b, box, rgbaDeep());
+	DeepPlane plane_a = render(a, box, rgbaDeep());
+
+	bool piped_b = true, piped_a = true;
+
+	for (Box::iterator it = box.begin(); it != box.end(); ++it)
+	{
+		if (it.x <= width / 3)
+			piped_b &= identical(output.getPixel(it), plane_b.getPixel(it));
+		else if (it.x >= width * 2 / 3)
+			piped_a &= identical(output.getPixel(it), plane_a.getPixel(it));
+	}
+
+	CHECK(piped_b);
+	CHECK(piped_a);
+
+	//without A, B is piped through everywhere
+	op->set_input(1, 0);
+	CHECK(identical(render(op, box, rgbaDeep()), plane_b));
+}
+
+
+static void checkThreads()
+{
+	int width = 48;
+	Op* op = keymix(makeScene(hair, width, 24, 3), makeScene(hair, width, 24, 4), ramp(width));
+	Box box(0, 0, width, 24);
+
+	for (int reduced = 0; reduced < 2; reduced++)
+	{
+		if (reduced)
+		{
+			setKnob(op, "opacity_cutoff", 0.995);
+			setKnob(op, "consolidate", true);
+			setKnob(op, "max_samples", 3);
+		}
+
+		setKnob(op, "max_threads", 1);
+		DeepPlane single = render(op, box, rgbaDeep());
+		setKnob(op, "max_threads", 4);
+		CHECK(identical(single, render(op, box, rgbaDeep())));
+		CHECK(identical(single, renderTiled(op, box, rgbaDeep(), 16, 8)));
+	}
+}
+
+
+static void timeMasks()
+{
+	const char* mask_names[] = {"mask 0", "mask 1", "mask 0.5", "ramp"};
+	FunctionSource* masks[] = {
+		new FunctionSource([](int, int) {return 0.0f;}),
+		new FunctionSource([](int, int) {return 1.0f;}),
+		new FunctionSource([](int, int) {return 0.5f;}),
+		ramp(400)
+	};
+
+	DeepSource* b = makeScene(hair, 400, 400, 5);
+	DeepSource* a = makeScene(hair, 400, 400, 6);
+
+	for (int m = 0; m < 4; m++)
+	{
+		std::string label = std::string("hair, ") + mask_names[m];
+		timeRender(label.c_str(), keymix(b, a, masks[m]), Box(0, 0, 400, 400), rgbaDeep());
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	std::vector<BenchCase> checks = {
+		{"mask 0 and 1 pipe the inputs through", checkPipeThrough},
+		{"threads and tiles give the same result", checkThreads}
+	};
+
+	std::vector<BenchCase> timings = {
+		{"masks", timeMasks}
+	};
+
+	return runBench(argc, argv, checks, timings);
+}
\ No newline at end of file
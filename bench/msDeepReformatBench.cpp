@@ -0,0 +1,325 @@
+/**
+checks and timings of msDeepReformat, see bench/README.md
+**/
+
+#include <cmath>
+#include <cstdio>
+#include "msDeepBench.h"
+
+
+
+//the type and resize type knobs, as listed in the plugin
+enum {to_format, to_box, scale};
+enum {none, width};
+
+
+static Op* reformat(DeepSource* source, double factor)
+{
+	Op* op = createPlugin("msDeepReformat");
+	op->set_input(0, source);
+	setKnob(op, "type", scale);
+	setKnob(op, "scale", factor);
+	return op;
+}
+
+
+//the merge settings that take the most code paths
+static void reduce(Op* op)
+{
+	setKnob(op, "opacity_cutoff", 0.995);
+	setKnob(op, "consolidate", true);
+	setKnob(op, "max_samples", 3);
+}
+
+
+//an integer downscale, which shares one footprint across the box, and one that doesn't
+static const double factors[] = {0.5, 0.37};
+
+
+static void checkThreads()
+{
+	DeepSource* source = makeScene(hair, 80, 48, 1);
+
+	for (int f = 0; f < 2; f++)
+	{
+		Op* op = reformat(source, factors[f]);
+		Box box(0, 0, 80 * factors[f], 48 * factors[f]);
+
+		for (int reduced = 0; reduced < 2; reduced++)
+		{
+			if (reduced)
+				reduce(op);
+
+			setKnob(op, "max_threads", 1);
+			DeepPlane single = render(op, box, rgbaDeep());
+			setKnob(op, "max_threads", 4);
+			CHECK(identical(single, render(op, box, rgbaDeep())));
+		}
+	}
+}
+
+
+static void checkTiles()
+{
+	DeepSource* source = makeScene(hair, 80, 48, 2);
+
+	for (int f = 0; f < 2; f++)
+	{
+		Op* op = reformat(source, factors[f]);
+		Box box(0, 0, 80 * factors[f], 48 * factors[f]);
+		CHECK(identical(render(op, box, rgbaDeep()), renderTiled(op, box, rgbaDeep(), 8, 5)));
+
+		reduce(op);
+		CHECK(identical(render(op, box, rgbaDeep()), renderTiled(op, box, rgbaDeep(), 8, 5)));
+	}
+}
+
+
+static void checkCache()
+{
+	DeepSource* source = makeScene(hair, 64, 32, 3);
+
+	for (int f = 0; f < 2; f++)
+	{
+		Op* op = reformat(source, factors[f]);
+		Box box(2, 2, 64 * factors[f] - 2, 32 * factors[f] - 2);
+		DeepPlane uncached = render(op, box, rgbaDeep());
+
+		setKnob(op, "cache_memory", 64);
+		CHECK(identical(uncached, render(op, box, rgbaDeep())));
+		CHECK(identical(uncached, render(op, box, rgbaDeep())));			//from the cache
+
+		//a changed input must not be served from the cache
+		source->setPixel(10, 10, std::vector<float>());
+		CHECK(identical(render(reformat(source, factors[f]), box, rgbaDeep()), render(op, box, rgbaDeep())));
+	}
+}
+
+
+//nothing gets dropped or consolidated, so pixels that are only moved don't need to be merged
+static void keepSamples(Op* op)
+{
+	setKnob(op, "drop_hidden", false);
+	setKnob(op, "drop_transparent", false);
+}
+
+
+//a scale of 1, or resize type none into a larger format, only moves the input pixels by whole pixels
+static void checkPassthrough()
+{
+	DeepSource* source = makeScene(fog, 40, 24, 4);
+	DeepPlane input = render(source, Box(0, 0, 40, 24), rgbaDeep());
+
+	Op* op = reformat(source, 1);
+	keepSamples(op);
+	CHECK(identical(input, render(op, Box(0, 0, 40, 24), rgbaDeep())));
+
+	Format larger(50, 30);
+	op = createPlugin("msDeepReformat");
+	op->set_input(0, source);
+	setKnob(op, "type", to_format);
+	setFormatKnob(op, "format", &larger);
+	setKnob(op, "resize", none);
+	keepSamples(op);
+
+	//the centers are 5 and 3 pixels apart
+	Box box(5, 3, 45, 27);
+	DeepPlane output = render(op, box, rgbaDeep());
+	bool moved = true;
+
+	for (Box::iterator it = box.begin(); it != box.end(); ++it)
+		moved &= identical(output.getPixel(it), input.getPixel(it.y - 3, it.x - 5));
+
+	CHECK(moved);
+}
+
+
+//pixels that are only moved still drop transparent samples and get consolidated; hair has transparent samples, which fog doesn't, so the flattened fog stays the same
+static void checkPassthroughReduced()
+{
+	Box box(0, 0, 40, 24);
+	DeepScene scenes[] = {hair, fog};
+
+	for (int s = 0; s < 2; s++)
+	{
+		DeepSource* source = makeScene(scenes[s], 40, 24, 4);
+		DeepPlane input = render(source, box, rgbaDeep());
+
+		Op* op = reformat(source, 1);
+		setKnob(op, "consolidate", true);
+		setKnob(op, "max_samples", 3);
+		DeepPlane output = render(op, box, rgbaDeep());
+		bool reduced = true;
+
+		for (Box::iterator it = box.begin(); it != box.end(); ++it)
+		{
+			DeepPixel pixel = output.getPixel(it);
+			reduced &= pixel.getSampleCount() <= 3;
+
+			for (size_t i = 0; i < pixel.getSampleCount(); i++)
+				reduced &= pixel.getUnorderedSample(i, Chan_Alpha) > 0;
+		}
+
+		CHECK(reduced);
+		CHECK(sampleCount(output) < sampleCount(input));
+
+		if (scenes[s] == fog)
+			CHECK(flatDifference(output, input) < 1e-4f);
+	}
+}
+
+
+//an output of a single pixel isn't a passthrough at a downscale: it filters its whole footprint, which covers inputs of 2 x 2 and 3 x 3 pixels, and with nothing dropped keeps all of their samples
+static void checkSinglePixel()
+{
+	for (int size = 2; size <= 3; size++)
+	{
+		DeepSource* source = makeScene(fog, size, size, 5);
+		Op* op = reformat(source, 0.5);
+		setKnob(op, "drop_hidden", false);
+		setKnob(op, "drop_transparent", false);
+
+		DeepPlane output = render(op, Box(0, 0, 1, 1), rgbaDeep());
+		CHECK(sampleCount(output) == sampleCount(render(source, Box(0, 0, size, size), rgbaDeep())));
+	}
+}
+
+
+//the input box getDeepRequests used to request for every output box before it requested inputBox: the corners of the input format, transformed like output pixels into the input and padded by the scale factor,
+//for the scale type with the default resize type and centering
+static Box oldRequestBox(int width, int height, double factor)
+{
+	double scale_factor = 1 / factor;
+	double size[2] = {(double)width, (double)height};
+	int range[2][2];
+
+	for (int axis = 0; axis < 2; axis++)
+	{
+		double center = (int)(size[axis] * factor) / 2.0;
+		double a = (0.5 - center) * scale_factor + size[axis] * 0.5 - 0.5;
+		double b = (size[axis] + 0.5 - center) * scale_factor + size[axis] * 0.5 - 0.5;
+		range[axis][0] = floor(std::min(a, b)) - ceil(scale_factor);
+		range[axis][1] = ceil(std::max(a, b)) + ceil(scale_factor);
+	}
+
+	return Box(range[0][0], range[1][0], range[0][1], range[1][1]);
+}
+
+
+//the box the op requests from its input for "box"
+static Box requestBox(Op* op, const Box& box)
+{
+	std::vector<RequestData> requests;
+	op->validate(true);
+	deepOp(op)->getDeepRequests(box, rgbaDeep(), 1, requests);
+	return requests[0].box;
+}
+
+
+//samples the source hands out for a box
+static size_t servedFor(DeepSource* source, const Box& box)
+{
+	resetServedSamples();
+	render(source, box, rgbaDeep());
+	return servedSamples();
+}
+
+
+//samples the source hands out for all tiles of the output of an op, under the request box of each tile and under the old request box
+static void requestedSamples(DeepSource* source, Op* op, int width, int height, double factor, int tile, size_t& requested, size_t& old_requested)
+{
+	Box output(0, 0, width * factor, height * factor);
+	size_t old_served = servedFor(source, oldRequestBox(width, height, factor));
+	requested = old_requested = 0;
+
+	for (int y = output.y(); y < output.t(); y += tile)
+	{
+		for (int x = output.x(); x < output.r(); x += tile)
+		{
+			requested += servedFor(source, requestBox(op, Box(x, y, std::min(x + tile, output.r()), std::min(y + tile, output.t()))));
+			old_requested += old_served;
+		}
+	}
+}
+
+
+//each tile requests exactly the input the op reads for it, which is less than the old request box asked for
+static void checkRequests()
+{
+	DeepSource* source = makeScene(hair, 80, 48, 6);
+	const double request_factors[] = {0.5, 0.37, 2};
+
+	for (int f = 0; f < 3; f++)
+	{
+		Op* op = reformat(source, request_factors[f]);
+		Box box(4, 4, 12, 10);
+		size_t requested = servedFor(source, requestBox(op, box));
+
+		resetServedSamples();
+		render(op, box, rgbaDeep());
+		CHECK(servedSamples() == requested);
+
+		size_t old_requested;
+		requestedSamples(source, op, 80, 48, request_factors[f], 16, requested, old_requested);
+		CHECK(requested < old_requested);
+	}
+}
+
+
+static void timeScales()
+{
+	DeepScene scenes[] = {hard_surface, hair, fog};
+	const char* scene_names[] = {"hard surface", "hair", "fog"};
+	const double timed_factors[] = {1, 0.5, 0.37, 2};
+
+	for (int s = 0; s < 3; s++)
+	{
+		DeepSource* source = makeScene(scenes[s], 400, 400, 5);
+
+		for (int f = 0; f < 4; f++)
+		{
+			char label[64];
+			snprintf(label, sizeof(label), "%s, scale %g", scene_names[s], timed_factors[f]);
+			timeRender(label, reformat(source, timed_factors[f]), Box(0, 0, 200, 200), rgbaDeep());
+		}
+	}
+}
+
+
+//the samples handed out for the requests of 64 x 64 output tiles of a 400 x 400 hair plate, against the old request box
+static void timeRequests()
+{
+	DeepSource* source = makeScene(hair, 400, 400, 5);
+	const double request_factors[] = {0.5, 1, 2};
+
+	for (int f = 0; f < 3; f++)
+	{
+		size_t requested, old_requested;
+		requestedSamples(source, reformat(source, request_factors[f]), 400, 400, request_factors[f], 64, requested, old_requested);
+		char label[64];
+		snprintf(label, sizeof(label), "hair, scale %g", request_factors[f]);
+		printf("%-32s requested %12zu   old request box %12zu (x%.1f)\n", label, requested, old_requested, (double)old_requested / std::max(requested, (size_t)1));
+		fflush(stdout);
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	std::vector<BenchCase> checks = {
+		{"threads give the same result", checkThreads},
+		{"tiles give the same result", checkTiles},
+		{"cache gives the same result", checkCache},
+		{"whole pixel moves pass the input through", checkPassthrough},
+		{"whole pixel moves still drop and consolidate", checkPassthroughReduced},
+		{"a single pixel filters its footprint", checkSinglePixel},
+		{"tiles request only what they read", checkRequests}
+	};
+
+	std::vector<BenchCase> timings = {
+		{"scales", timeScales},
+		{"request boxes", timeRequests}
+	};
+
+	return runBench(argc, argv, checks, timings);
+}
\ No newline at end of file
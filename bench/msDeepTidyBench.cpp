@@ -0,0 +1,108 @@
+/**
+checks and timings of msDeepTidy, see bench/README.md
+**/
+
+#include <cstdio>
+#include "msDeepBench.h"
+
+
+
+static Op* tidy(Op* input)
+{
+	Op* op = createPlugin("msDeepTidy");
+	op->set_input(0, input);
+	return op;
+}
+
+
+//splitting and merging samples must not change how the pixels look; flattening overlapping samples needs them to be tidy,
+//so apart from hard surfaces, which never overlap, it is checked that tidying twice looks the same as tidying once
+static void checkFlatten()
+{
+	Box box(0, 0, 32, 16);
+	DeepSource* source = makeScene(hard_surface, 32, 16, 1);
+	CHECK(flatDifference(render(tidy(source), box, rgbaDeep()), render(source, box, rgbaDeep())) < 1e-5f);
+
+	DeepScene scenes[] = {hair, fog};
+
+	for (int s = 0; s < 2; s++)
+	{
+		Op* once = tidy(makeScene(scenes[s], 32, 16, 1));
+		CHECK(flatDifference(render(tidy(once), box, rgbaDeep()), render(once, box, rgbaDeep())) < 1e-4f);
+	}
+}
+
+
+//no samples overlap, so the samples are ordered by both their front and their back depth
+static void checkTidy()
+{
+	DeepScene scenes[] = {hair, fog};
+
+	for (int s = 0; s < 2; s++)
+	{
+		Box box(0, 0, 32, 16);
+		DeepPlane output = render(tidy(makeScene(scenes[s], 32, 16, 2)), box, rgbaDeep());
+		bool ordered = true;
+
+		for (Box::iterator it = box.begin(); it != box.end(); ++it)
+		{
+			DeepPixel pixel = output.getPixel(it);
+
+			for (size_t i = 1; i < pixel.getSampleCount(); i++)
+				ordered &= pixel.getOrderedSample(i - 1, Chan_DeepFront) >= pixel.getOrderedSample(i, Chan_DeepBack);
+		}
+
+		CHECK(ordered);
+	}
+}
+
+
+static void checkThreads()
+{
+	Op* op = tidy(makeScene(fog, 32, 24, 3));
+	Box box(0, 0, 32, 24);
+
+	setKnob(op, "max_threads", 1);
+	DeepPlane single = render(op, box, rgbaDeep());
+	setKnob(op, "max_threads", 4);
+	CHECK(identical(single, render(op, box, rgbaDeep())));
+	CHECK(identical(single, renderTiled(op, box, rgbaDeep(), 16, 8)));
+}
+
+
+//depth and alpha decide how the samples get split and merged, even if only colors are requested
+static void checkChannels()
+{
+	Op* op = tidy(makeScene(fog, 32, 16, 5));
+	Box box(0, 0, 32, 16);
+	CHECK(sameChannels(render(op, box, Mask_RGB), render(op, box, rgbaDeep())));
+}
+
+
+static void timeScenes()
+{
+	DeepScene scenes[] = {hard_surface, hair, fog};
+	const char* scene_names[] = {"hard surface", "hair", "fog"};
+
+	for (int s = 0; s < 3; s++)
+	{
+		timeRender(scene_names[s], tidy(makeScene(scenes[s], 400, 400, 4)), Box(0, 0, 400, 400), rgbaDeep());
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	std::vector<BenchCase> checks = {
+		{"flattened pixels don't change", checkFlatten},
+		{"samples don't overlap", checkTidy},
+		{"threads and tiles give the same result", checkThreads},
+		{"colors are split and merged by depth and alpha", checkChannels}
+	};
+
+	std::vector<BenchCase> timings = {
+		{"scenes", timeScenes}
+	};
+
+	return runBench(argc, argv, checks, timings);
+}
\ No newline at end of file
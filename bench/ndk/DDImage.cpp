@@ -0,0 +1,231 @@
+//definitions of the stand-in Nuke NDK, see bench/README.md
+
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <thread>
+#include "DDImage/DeepOp.h"
+#include "DDImage/Thread.h"
+
+
+namespace DD {
+namespace Image {
+
+
+Knob Knob::showPanel("showPanel");
+
+
+void Knob::set_value(double value, int index)
+{
+	if ((index < 0) || (index >= _count))
+	{
+		fprintf(stderr, "knob %s has no value %d\n", _name.c_str(), index);
+		abort();
+	}
+
+	switch (_type)
+	{
+		case BOOL: ((bool*)_value)[index] = (value != 0); break;
+		case INT: ((int*)_value)[index] = (int)value; break;
+		case FLOAT: ((float*)_value)[index] = (float)value; break;
+		case DOUBLE: ((double*)_value)[index] = value; break;
+		case CHANNEL: ((Channel*)_value)[index] = (Channel)(int)value; break;
+
+		default:
+			fprintf(stderr, "knob %s doesn't hold a number\n", _name.c_str());
+			abort();
+	}
+}
+
+
+double Knob::get_value(int index) const
+{
+	if ((index < 0) || (index >= _count))
+		return 0;
+
+	switch (_type)
+	{
+		case BOOL: return ((bool*)_value)[index];
+		case INT: return ((int*)_value)[index];
+		case FLOAT: return ((float*)_value)[index];
+		case DOUBLE: return ((double*)_value)[index];
+		case CHANNEL: return ((Channel*)_value)[index];
+		default: return 0;
+	}
+}
+
+
+void Knob::set_text(const char* text)
+{
+	_text = text ? text : "";
+
+	if (_type == STRING)
+		*(const char**)_value = _text.c_str();
+}
+
+
+const char* Knob::get_text() const
+{
+	return _text.c_str();
+}
+
+
+void Knob::set_format(const FormatPair& formats)
+{
+	if (_type != FORMAT)
+	{
+		fprintf(stderr, "knob %s doesn't hold a format\n", _name.c_str());
+		abort();
+	}
+
+	*(FormatPair*)_value = formats;
+}
+
+
+void Knob::append(Hash& hash) const
+{
+	if (flag(NO_RERENDER) || (_type == NONE))
+		return;
+
+	hash.append(_name.c_str());
+
+	if (_type == STRING)
+		hash.append(_text.c_str());
+
+	else if (_type == FORMAT)
+	{
+		const Format* format = ((FormatPair*)_value)->format();
+
+		if (format)
+		{
+			hash.append(format->x());
+			hash.append(format->y());
+			hash.append(format->r());
+			hash.append(format->t());
+			hash.append(format->width());
+			hash.append(format->height());
+			hash.append(format->pixel_aspect());
+		}
+	}
+
+	else
+	{
+		for (int i = 0; i < _count; i++)
+			hash.append(get_value(i));
+	}
+}
+
+
+static std::map<std::string, Op::Description::Constructor>& plugins()
+{
+	static std::map<std::string, Op::Description::Constructor> registry;
+	return registry;
+}
+
+
+Op::Description::Description(const char* name, int, Constructor constructor)
+{
+	plugins()[name] = constructor;
+}
+
+
+Op* Op::Description::create(const char* name)
+{
+	std::map<std::string, Constructor>::iterator it = plugins().find(name);
+	return (it == plugins().end()) ? 0 : it->second(0);
+}
+
+
+void Op::set_input(int i, Op* op)
+{
+	if (i >= (int)_inputs.size())
+		_inputs.resize(i + 1, 0);
+
+	_inputs[i] = op;
+}
+
+
+void Op::createKnobs()
+{
+	if (knobs_created)
+		return;
+
+	knobs_created = true;
+	knobs(&knob_list);
+}
+
+
+const Format& Op::input_format() const
+{
+	static const Format empty;
+	DeepOp* deep = dynamic_cast<DeepOp*>(input(0));
+
+	return (deep && deep->deepInfo().format()) ? *deep->deepInfo().format() : empty;
+}
+
+
+Knob* Op::knob(const char* name)
+{
+	createKnobs();
+	return knob_list.find(name);
+}
+
+
+void Op::validate(bool for_real)
+{
+	createKnobs();
+
+	for (size_t i = 0; i < _inputs.size(); i++)
+		if (_inputs[i])
+			_inputs[i]->validate(for_real);
+
+	_hash.reset();
+	_hash.append(Class());
+	knob_list.append(_hash);
+
+	for (size_t i = 0; i < _inputs.size(); i++)
+		_hash.append(_inputs[i] ? _inputs[i]->hash().value() : 0);
+
+	append(_hash);
+	_validate(for_real);
+}
+
+
+unsigned Thread::numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+static std::mutex spawn_mutex;
+static std::map<void*, std::vector<std::thread> > spawned;
+
+
+void Thread::spawn(ThreadFunction* function, int threads, void* data)
+{
+	std::vector<std::thread> started;
+
+	for (int i = 0; i < threads; i++)
+		started.push_back(std::thread(function, (unsigned)i, (unsigned)threads, data));
+
+	std::lock_guard<std::mutex> guard(spawn_mutex);
+	std::vector<std::thread>& list = spawned[data];
+
+	for (size_t i = 0; i < started.size(); i++)
+		list.push_back(std::move(started[i]));
+}
+
+
+void Thread::wait(void* data)
+{
+	std::vector<std::thread> threads;
+
+	{
+		std::lock_guard<std::mutex> guard(spawn_mutex);
+		threads.swap(spawned[data]);
+		spawned.erase(data);
+	}
+
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+
+}
+}
\ No newline at end of file
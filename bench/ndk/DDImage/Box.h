@@ -0,0 +1,130 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <algorithm>
+
+
+namespace DD {
+namespace Image {
+
+
+class Box
+{
+	private:
+		int _x, _y, _r, _t;
+
+	public:
+		Box() : _x(0), _y(0), _r(1), _t(1) {}
+		Box(int x, int y, int r, int t) : _x(x), _y(y), _r(r), _t(t) {}
+
+		int x() const {return _x;}
+		int y() const {return _y;}
+		int r() const {return _r;}
+		int t() const {return _t;}
+		int w() const {return _r - _x;}
+		int h() const {return _t - _y;}
+
+		void x(int v) {_x = v;}
+		void y(int v) {_y = v;}
+		void r(int v) {_r = v;}
+		void t(int v) {_t = v;}
+		void set(int x, int y, int r, int t) {_x = x; _y = y; _r = r; _t = t;}
+
+		void merge(const Box& other)
+		{
+			_x = std::min(_x, other._x);
+			_y = std::min(_y, other._y);
+			_r = std::max(_r, other._r);
+			_t = std::max(_t, other._t);
+		}
+
+		void intersect(int x, int y, int r, int t)
+		{
+			_x = std::max(_x, x);
+			_y = std::max(_y, y);
+			_r = std::min(_r, r);
+			_t = std::min(_t, t);
+		}
+
+		void intersect(const Box& other) {intersect(other._x, other._y, other._r, other._t);}
+
+		//visits the pixels row by row, from the bottom left
+		struct iterator
+		{
+			int x, y, left, right;
+
+			bool operator!=(const iterator& other) const {return (x != other.x) || (y != other.y);}
+
+			iterator& operator++()
+			{
+				if (++x >= right)
+				{
+					x = left;
+					y++;
+				}
+
+				return *this;
+			}
+
+			iterator operator++(int)
+			{
+				iterator previous = *this;
+				++*this;
+				return previous;
+			}
+		};
+
+		iterator begin() const
+		{
+			iterator it = {_x, (_x < _r) ? _y : _t, _x, _r};
+			return it;
+		}
+
+		iterator end() const
+		{
+			iterator it = {_x, _t, _x, _r};
+			return it;
+		}
+};
+
+
+class Format : public Box
+{
+	private:
+		int _width, _height;
+		double _pixel_aspect;
+
+	public:
+		Format() : Box(0, 0, 0, 0), _width(0), _height(0), _pixel_aspect(1) {}
+		Format(int width, int height, double pixel_aspect = 1) : Box(0, 0, width, height), _width(width), _height(height), _pixel_aspect(pixel_aspect) {}
+
+		int width() const {return _width;}
+		int height() const {return _height;}
+		double pixel_aspect() const {return _pixel_aspect;}
+		void width(int v) {_width = v;}
+		void height(int v) {_height = v;}
+		void pixel_aspect(double v) {_pixel_aspect = v;}
+
+		float center_x() const {return (x() + r()) / 2.0f;}
+		float center_y() const {return (y() + t()) / 2.0f;}
+};
+
+
+class FormatPair
+{
+	private:
+		const Format* _format;
+		const Format* _full_size_format;
+
+	public:
+		FormatPair() : _format(0), _full_size_format(0) {}
+
+		const Format* format() const {return _format;}
+		const Format* fullSizeFormat() const {return _full_size_format ? _full_size_format : _format;}
+		void format(const Format* f) {_format = f;}
+		void fullSizeFormat(const Format* f) {_full_size_format = f;}
+};
+
+
+}
+}
@@ -0,0 +1,103 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+
+namespace DD {
+namespace Image {
+
+
+typedef uint64_t U64;
+
+enum Channel {Chan_Black = 0, Chan_Red, Chan_Green, Chan_Blue, Chan_Alpha, Chan_Z, Chan_Mask, Chan_U, Chan_V, Chan_DeepFront, Chan_DeepBack, Chan_Last = 63};
+
+enum ChannelSetInit
+{
+	Mask_None = 0,
+	Mask_Red = 1 << Chan_Red,
+	Mask_Green = 1 << Chan_Green,
+	Mask_Blue = 1 << Chan_Blue,
+	Mask_Alpha = 1 << Chan_Alpha,
+	Mask_RGB = Mask_Red | Mask_Green | Mask_Blue,
+	Mask_RGBA = Mask_RGB | Mask_Alpha,
+	Mask_DeepFront = 1 << Chan_DeepFront,
+	Mask_DeepBack = 1 << Chan_DeepBack,
+	Mask_Deep = Mask_DeepFront | Mask_DeepBack
+};
+
+
+//a set of channels, iterated in ascending channel order
+class ChannelSet
+{
+	private:
+		U64 bits;
+
+	public:
+		ChannelSet() : bits(0) {}
+		ChannelSet(Channel z) : bits(z ? (U64)1 << z : 0) {}
+		ChannelSet(ChannelSetInit mask) : bits((U64)mask) {}
+
+		bool contains(Channel z) const {return z && ((bits >> z) & 1);}
+		bool empty() const {return bits == 0;}
+		unsigned size() const {return __builtin_popcountll(bits);}
+
+		Channel first() const {return next(Chan_Black);}
+
+		Channel next(Channel z) const
+		{
+			for (int i = z + 1; i <= Chan_Last; i++)
+				if ((bits >> i) & 1)
+					return (Channel)i;
+
+			return Chan_Black;
+		}
+
+		ChannelSet& operator+=(Channel z) {if (z) bits |= (U64)1 << z; return *this;}
+		ChannelSet& operator+=(ChannelSetInit mask) {bits |= (U64)mask; return *this;}
+		ChannelSet& operator+=(const ChannelSet& other) {bits |= other.bits; return *this;}
+		ChannelSet& operator-=(Channel z) {if (z) bits &= ~((U64)1 << z); return *this;}
+		ChannelSet& operator&=(const ChannelSet& other) {bits &= other.bits; return *this;}
+
+		bool operator==(const ChannelSet& other) const {return bits == other.bits;}
+		bool operator!=(const ChannelSet& other) const {return bits != other.bits;}
+};
+
+typedef const ChannelSet& ChannelMask;
+
+#define foreach(VAR, CHANNELS) for (DD::Image::Channel VAR = (CHANNELS).first(); VAR; VAR = (CHANNELS).next(VAR))
+
+
+//positions of the channels of a set in a sample, in ascending channel order
+class ChannelMap
+{
+	private:
+		std::vector<Channel> channel_list;
+		int position[Chan_Last + 1];
+
+	public:
+		ChannelMap()
+		{
+			for (int i = 0; i <= Chan_Last; i++)
+				position[i] = -1;
+		}
+
+		ChannelMap(const ChannelSet& channels) : ChannelMap()
+		{
+			foreach (z, channels)
+			{
+				position[z] = channel_list.size();
+				channel_list.push_back(z);
+			}
+		}
+
+		int chanNo(Channel z) const {return position[z];}
+		bool contains(Channel z) const {return z && (position[z] >= 0);}
+		unsigned size() const {return channel_list.size();}
+		Channel operator[](int i) const {return channel_list[i];}
+};
+
+
+}
+}
@@ -0,0 +1,15 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <cfloat>
+
+
+namespace DD {
+namespace Image {
+
+
+inline float clamp(float f) {return (f < 0) ? 0 : (f > 1) ? 1 : f;}
+
+
+}
+}
@@ -0,0 +1,82 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include "DeepPlane.h"
+#include "Knobs.h"
+#include "Op.h"
+#include "RequestData.h"
+
+
+namespace DD {
+namespace Image {
+
+
+class DeepInfo
+{
+	private:
+		FormatPair _formats;
+		Box _box;
+		ChannelSet _channels;
+
+	public:
+		DeepInfo() : _box(0, 0, 0, 0) {}
+		DeepInfo(const FormatPair& formats, const Box& box, const ChannelSet& channels) : _formats(formats), _box(box), _channels(channels) {}
+
+		const Format* format() const {return _formats.format();}
+		const Format* fullSizeFormat() const {return _formats.fullSizeFormat();}
+		const FormatPair& formats() const {return _formats;}
+		const Box& box() const {return _box;}
+		const ChannelSet& channels() const {return _channels;}
+
+		int x() const {return _box.x();}
+		int y() const {return _box.y();}
+		int r() const {return _box.r();}
+		int t() const {return _box.t();}
+
+		void setFormats(const FormatPair& formats) {_formats = formats;}
+		void setBox(const Box& box) {_box = box;}
+		void setChannels(const ChannelSet& channels) {_channels = channels;}
+};
+
+
+class DeepOp
+{
+	protected:
+		DeepInfo _deepInfo;
+
+	public:
+		virtual ~DeepOp() {}
+
+		virtual Op* op() = 0;
+
+		const DeepInfo& deepInfo() const {return _deepInfo;}
+		void validate(bool for_real = true) {op()->validate(for_real);}
+
+		virtual void getDeepRequests(Box, const ChannelSet&, int, std::vector<RequestData>&) {}
+		virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& plane) = 0;
+
+		//renders a box, as an op does when it reads from its input
+		bool deepEngine(Box box, const ChannelSet& channels, DeepPlane& plane)
+		{
+			DeepOutputPlane outPlane;
+
+			if (!doDeepEngine(box, channels, outPlane))
+				return false;
+
+			plane = DeepPlane(outPlane);
+			return true;
+		}
+};
+
+
+class DeepOnlyOp : public Op, public DeepOp
+{
+	public:
+		DeepOnlyOp(Node* node) : Op(node) {}
+
+		using Op::validate;
+};
+
+
+}
+}
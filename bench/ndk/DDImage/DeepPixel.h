@@ -0,0 +1,52 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <vector>
+#include "ChannelSet.h"
+
+
+namespace DD {
+namespace Image {
+
+
+//read access to the samples of one pixel of a DeepPlane
+//samples are stored with all channels of the plane back to back; the ordered samples go from the furthest (0) to the closest front depth
+class DeepPixel
+{
+	private:
+		const ChannelMap* channel_map;
+		const float* values;
+		size_t sample_count;
+		const int* order;
+
+	public:
+		DeepPixel(const ChannelMap& channels, const float* data, size_t count, const int* ordered) : channel_map(&channels), values(data), sample_count(count), order(ordered) {}
+
+		size_t getSampleCount() const {return sample_count;}
+		const ChannelMap& channels() const {return *channel_map;}
+		const float* data() const {return values;}
+
+		const float& getUnorderedSample(size_t sample, Channel z) const
+		{
+			static const float zero = 0;
+			int c = channel_map->chanNo(z);
+			return (c < 0) ? zero : values[sample * channel_map->size() + c];
+		}
+
+		const float& getOrderedSample(size_t sample, Channel z) const {return getUnorderedSample(order[sample], z);}
+};
+
+
+//the samples of a pixel being written, all channels of the output plane back to back
+class DeepOutPixel : public std::vector<float>
+{
+	public:
+		DeepOutPixel() {}
+		explicit DeepOutPixel(size_t size) {reserve(size);}
+
+		void reserveMore(size_t size) {reserve(this->size() + size);}
+};
+
+
+}
+}
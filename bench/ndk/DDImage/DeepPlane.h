@@ -0,0 +1,122 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include "Box.h"
+#include "DeepPixel.h"
+
+
+namespace DD {
+namespace Image {
+
+
+//the pixels of a box as an op writes them, in the order of the box iterator
+class DeepOutputPlane
+{
+	private:
+		ChannelSet _channels;
+		Box _box;
+		std::vector<DeepOutPixel> pixels;
+
+		friend class DeepPlane;
+
+	public:
+		DeepOutputPlane() {}
+		DeepOutputPlane(const ChannelSet& channels, const Box& box) : _channels(channels), _box(box) {}
+
+		const ChannelSet& channels() const {return _channels;}
+		const Box& box() const {return _box;}
+
+		void addPixel(const DeepOutPixel& pixel) {pixels.push_back(pixel);}
+		void addHole() {pixels.push_back(DeepOutPixel());}
+};
+
+
+//the pixels of a box as an op reads them from its input
+class DeepPlane
+{
+	private:
+		ChannelSet _channels;
+		ChannelMap channel_map;
+		Box _box;
+		std::vector<float> values;
+		std::vector<size_t> first;			//first sample of each pixel, plus the end of the last one
+		std::vector<int> order;				//stored index of each ordered sample, per pixel
+
+		size_t index(int y, int x) const
+		{
+			if ((x < _box.x()) || (x >= _box.r()) || (y < _box.y()) || (y >= _box.t()))
+			{
+				fprintf(stderr, "DeepPlane::getPixel(%d, %d) outside of the plane\n", y, x);
+				abort();
+			}
+
+			return (size_t)(y - _box.y()) * _box.w() + x - _box.x();
+		}
+
+	public:
+		DeepPlane() : first(1, 0) {}
+
+		//takes over the pixels an op has written; aborts if it didn't write exactly one pixel per position of the box
+		explicit DeepPlane(const DeepOutputPlane& plane) : _channels(plane._channels), channel_map(plane._channels), _box(plane._box), first(1, 0)
+		{
+			size_t pixel_count = (size_t)std::max(_box.w(), 0) * std::max(_box.h(), 0);
+			size_t channel_count = channel_map.size();
+			int front = channel_map.chanNo(Chan_DeepFront);
+			int back = channel_map.chanNo(Chan_DeepBack);
+
+			if (plane.pixels.size() != pixel_count)
+			{
+				fprintf(stderr, "DeepOutputPlane holds %zu pixels instead of %zu\n", plane.pixels.size(), pixel_count);
+				abort();
+			}
+
+			for (size_t i = 0; i < pixel_count; i++)
+			{
+				const DeepOutPixel& pixel = plane.pixels[i];
+
+				if ((channel_count == 0 && !pixel.empty()) || (channel_count > 0 && pixel.size() % channel_count))
+				{
+					fprintf(stderr, "pixel %zu holds %zu values, which are no whole number of samples of %zu channels\n", i, pixel.size(), channel_count);
+					abort();
+				}
+
+				size_t count = channel_count ? pixel.size() / channel_count : 0;
+				size_t offset = order.size();
+				values.insert(values.end(), pixel.begin(), pixel.end());
+				first.push_back(first.back() + count);
+
+				for (size_t s = 0; s < count; s++)
+					order.push_back(s);
+
+				//furthest front first, then furthest back; samples at the same depth keep their stored order
+				if (front >= 0)
+					std::stable_sort(order.begin() + offset, order.end(), [&](int a, int b)
+					{
+						const float* sample_a = &pixel[a * channel_count];
+						const float* sample_b = &pixel[b * channel_count];
+
+						if (sample_a[front] != sample_b[front])
+							return sample_a[front] > sample_b[front];
+
+						return (back >= 0) && (sample_a[back] > sample_b[back]);
+					});
+			}
+		}
+
+		const ChannelSet& channels() const {return _channels;}
+		const Box& box() const {return _box;}
+
+		DeepPixel getPixel(int y, int x) const
+		{
+			size_t i = index(y, x);
+			return DeepPixel(channel_map, values.data() + first[i] * channel_map.size(), first[i + 1] - first[i], order.data() + first[i]);
+		}
+
+		DeepPixel getPixel(const Box::iterator& it) const {return getPixel(it.y, it.x);}
+};
+
+
+}
+}
@@ -0,0 +1,29 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <vector>
+#include "DeepOp.h"
+#include "Iop.h"
+
+
+namespace DD {
+namespace Image {
+
+
+//a single sample with the channels of a channel map
+class DeepSample
+{
+	private:
+		ChannelMap _channels;
+		std::vector<float> _values;
+
+	public:
+		DeepSample(const ChannelMap& channels) : _channels(channels), _values(channels.size(), 0.0f) {}
+
+		float& operator[](Channel z) {return _values[_channels.chanNo(z)];}
+		float operator[](Channel z) const {return _values[_channels.chanNo(z)];}
+};
+
+
+}
+}
@@ -0,0 +1,47 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <cstring>
+#include <string>
+#include "ChannelSet.h"
+
+
+namespace DD {
+namespace Image {
+
+
+//64 bit FNV-1a over everything appended
+class Hash
+{
+	private:
+		U64 _value;
+
+	public:
+		Hash() {reset();}
+
+		void reset() {_value = 14695981039346656037ull;}
+		U64 value() const {return _value;}
+
+		void append(const void* data, size_t size)
+		{
+			const unsigned char* bytes = (const unsigned char*)data;
+
+			for (size_t i = 0; i < size; i++)
+				_value = (_value ^ bytes[i]) * 1099511628211ull;
+		}
+
+		void append(U64 v) {append(&v, sizeof(v));}
+		void append(int v) {append(&v, sizeof(v));}
+		void append(unsigned v) {append(&v, sizeof(v));}
+		void append(float v) {append(&v, sizeof(v));}
+		void append(double v) {append(&v, sizeof(v));}
+		void append(const char* s) {append(s, s ? strlen(s) : 0);}
+		void append(const Hash& other) {append(other._value);}
+
+		bool operator==(const Hash& other) const {return _value == other._value;}
+		bool operator!=(const Hash& other) const {return _value != other._value;}
+};
+
+
+}
+}
@@ -0,0 +1,32 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include "DDMath.h"
+#include "Op.h"
+#include "Row.h"
+
+
+namespace DD {
+namespace Image {
+
+
+//a flat image op; subclasses fill rows in engine()
+class Iop : public Op
+{
+	public:
+		Iop(Node* node) : Op(node) {}
+
+		virtual void engine(int y, int x, int r, ChannelMask channels, Row& row) = 0;
+
+		void get(int y, int x, int r, ChannelMask channels, Row& row) {engine(y, x, r, channels, row);}
+		float at(int x, int y, Channel z)
+		{
+			Row row(x, x + 1);
+			get(y, x, x + 1, z, row);
+			return row[z][x];
+		}
+};
+
+
+}
+}
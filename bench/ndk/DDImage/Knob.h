@@ -0,0 +1,105 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+//knobs are bound to the members of an op when its knobs() is called, so checks can set them by name like a Nuke script would
+#pragma once
+
+#include <list>
+#include <string>
+#include "Box.h"
+#include "Hash.h"
+
+
+namespace DD {
+namespace Image {
+
+
+class Knob
+{
+	public:
+		enum
+		{
+			STARTLINE = 1 << 0,
+			SLIDER = 1 << 1,
+			DISABLED = 1 << 2,
+			NO_ANIMATION = 1 << 3,
+			READ_ONLY = 1 << 4,
+			DO_NOT_WRITE = 1 << 5,
+			NO_RERENDER = 1 << 6,
+			HIDDEN = 1 << 7,
+			ENDLINE = 1 << 8
+		};
+
+		typedef unsigned FlagMask;
+
+		//type of the member a knob is bound to
+		enum Type {NONE, BOOL, INT, FLOAT, DOUBLE, CHANNEL, STRING, FORMAT};
+
+		static Knob showPanel;			//passed to knob_changed when the panel of a node opens
+
+		Knob(const std::string& name = "", Type type = NONE, void* value = 0, int count = 0) : _name(name), _type(type), _value(value), _count(count), _flags(0) {}
+
+		const char* name() const {return _name.c_str();}
+		bool is(const char* name) const {return _name == name;}
+		int count() const {return _count;}
+
+		void set_flag(FlagMask flags) {_flags |= flags;}
+		void clear_flag(FlagMask flags) {_flags &= ~flags;}
+		bool flag(FlagMask flags) const {return (_flags & flags) != 0;}
+
+		void enable(bool) {}
+		void visible(bool) {}
+		void label(const char*) {}
+
+		void set_value(double value, int index = 0);
+		double get_value(int index = 0) const;
+		void set_text(const char* text);
+		const char* get_text() const;
+		void set_format(const FormatPair& formats);
+
+		void append(Hash& hash) const;		//adds the current value, as Nuke does for all knobs that affect the render
+
+	private:
+		std::string _name;
+		Type _type;
+		void* _value;
+		int _count;
+		FlagMask _flags;
+		std::string _text;
+};
+
+
+//the knobs of one op, in the order knobs() created them
+class KnobList
+{
+	private:
+		std::list<Knob> knob_list;
+
+	public:
+		Knob* add(const char* name, Knob::Type type = Knob::NONE, void* value = 0, int count = 0)
+		{
+			knob_list.push_back(Knob(name ? name : "", type, value, count));
+			return &knob_list.back();
+		}
+
+		Knob* last() {return knob_list.empty() ? 0 : &knob_list.back();}
+
+		Knob* find(const char* name)
+		{
+			for (std::list<Knob>::iterator it = knob_list.begin(); it != knob_list.end(); it++)
+				if (it->is(name))
+					return &*it;
+
+			return 0;
+		}
+
+		void append(Hash& hash) const
+		{
+			for (std::list<Knob>::const_iterator it = knob_list.begin(); it != knob_list.end(); it++)
+				it->append(hash);
+		}
+};
+
+typedef KnobList* Knob_Callback;
+
+
+}
+}
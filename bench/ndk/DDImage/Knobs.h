@@ -0,0 +1,34 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include "Knob.h"
+
+
+namespace DD {
+namespace Image {
+
+
+inline Knob* Bool_knob(Knob_Callback f, bool* p, const char* name, const char* = 0) {return f->add(name, Knob::BOOL, p, 1);}
+inline Knob* Int_knob(Knob_Callback f, int* p, const char* name, const char* = 0) {return f->add(name, Knob::INT, p, 1);}
+inline Knob* Float_knob(Knob_Callback f, float* p, const char* name, const char* = 0) {return f->add(name, Knob::FLOAT, p, 1);}
+inline Knob* Float_knob(Knob_Callback f, double* p, const char* name, const char* = 0) {return f->add(name, Knob::DOUBLE, p, 1);}
+inline Knob* WH_knob(Knob_Callback f, float* p, const char* name, const char* = 0) {return f->add(name, Knob::FLOAT, p, 2);}
+inline Knob* Scale_knob(Knob_Callback f, double* p, const char* name, const char* = 0) {return f->add(name, Knob::DOUBLE, p, 2);}
+inline Knob* Enumeration_knob(Knob_Callback f, int* p, const char* const*, const char* name, const char* = 0) {return f->add(name, Knob::INT, p, 1);}
+inline Knob* Input_Channel_knob(Knob_Callback f, Channel* p, int, int, const char* name, const char* = 0) {return f->add(name, Knob::CHANNEL, p, 1);}
+inline Knob* Format_knob(Knob_Callback f, FormatPair* p, const char* name, const char* = 0) {return f->add(name, Knob::FORMAT, p, 1);}
+inline Knob* File_knob(Knob_Callback f, const char** p, const char* name, const char* = 0) {return f->add(name, Knob::STRING, p, 1);}
+inline Knob* Multiline_String_knob(Knob_Callback f, const char** p, const char* name, const char* = 0, int = 0) {return f->add(name, Knob::STRING, p, 1);}
+inline Knob* Button(Knob_Callback f, const char* name, const char* = 0) {return f->add(name);}
+inline Knob* Tab_knob(Knob_Callback f, const char* name) {return f->add(name);}
+inline Knob* Text_knob(Knob_Callback f, const char*, const char* = 0) {return f->add("");}
+inline Knob* Divider(Knob_Callback f, const char* = 0) {return f->add("");}
+inline void Newline(Knob_Callback, const char* = 0) {}
+inline void Tooltip(Knob_Callback, const char*) {}
+inline void SetRange(Knob_Callback, double, double) {}
+inline void SetFlags(Knob_Callback f, Knob::FlagMask flags) {if (f->last()) f->last()->set_flag(flags);}
+inline void ClearFlags(Knob_Callback f, Knob::FlagMask flags) {if (f->last()) f->last()->clear_flag(flags);}
+
+
+}
+}
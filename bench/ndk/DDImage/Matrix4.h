@@ -0,0 +1,66 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+//only the 2D scale and translation the plugins use
+#pragma once
+
+
+namespace DD {
+namespace Image {
+
+
+struct Vector2
+{
+	float x, y;
+
+	Vector2() : x(0), y(0) {}
+	Vector2(float a, float b) : x(a), y(b) {}
+	void set(float a, float b) {x = a; y = b;}
+};
+
+
+class Matrix4
+{
+	private:
+		double a00, a01, a03, a10, a11, a13;
+
+	public:
+		Matrix4() {makeIdentity();}
+
+		void makeIdentity()
+		{
+			a00 = a11 = 1;
+			a01 = a03 = a10 = a13 = 0;
+		}
+
+		void translate(double x, double y)
+		{
+			a03 += a00 * x + a01 * y;
+			a13 += a10 * x + a11 * y;
+		}
+
+		void scale(double x, double y)
+		{
+			a00 *= x;
+			a10 *= x;
+			a01 *= y;
+			a11 *= y;
+		}
+
+		Matrix4 inverse() const
+		{
+			Matrix4 m;
+			double d = a00 * a11 - a01 * a10;
+			m.a00 = a11 / d;
+			m.a11 = a00 / d;
+			m.a01 = -a01 / d;
+			m.a10 = -a10 / d;
+			m.a03 = -(m.a00 * a03 + m.a01 * a13);
+			m.a13 = -(m.a10 * a03 + m.a11 * a13);
+			return m;
+		}
+
+		Vector2 transform(const Vector2& v) const {return Vector2(a00 * v.x + a01 * v.y + a03, a10 * v.x + a11 * v.y + a13);}
+};
+
+
+}
+}
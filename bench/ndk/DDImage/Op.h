@@ -0,0 +1,75 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <vector>
+#include "Box.h"
+#include "DDMath.h"
+#include "Hash.h"
+#include "Knob.h"
+
+
+namespace DD {
+namespace Image {
+
+
+class Node;
+
+
+class Op
+{
+	public:
+		//registers a plugin under its class name, so checks can create it like Nuke does from a script
+		class Description
+		{
+			public:
+				typedef Op* (*Constructor)(Node*);
+
+				Description(const char* name, int, Constructor constructor);
+				static Op* create(const char* name);
+		};
+
+		Op(Node*) {}
+		virtual ~Op() {}
+
+		virtual const char* Class() const = 0;
+		virtual const char* node_help() const {return "";}
+		const char* node_name() const {return Class();}
+
+		virtual int minimum_inputs() const {return 1;}
+		virtual int maximum_inputs() const {return 1;}
+		virtual bool test_input(int, Op*) const {return true;}
+		virtual Op* default_input(int) const {return 0;}
+
+		Op* input(int i) const {return (i < (int)_inputs.size()) ? _inputs[i] : 0;}
+		const Format& input_format() const;											//the format of the first input
+		int inputs() const {return _inputs.size();}
+		void set_input(int i, Op* op);
+
+		virtual void knobs(Knob_Callback) {}
+		virtual int knob_changed(Knob*) {return 0;}
+		Knob* knob(const char* name);
+
+		//validates the inputs, hashes the class, the knobs that affect the render and the inputs, then calls _validate
+		void validate(bool for_real = true);
+		virtual void _validate(bool) {}
+		virtual void append(Hash&) {}
+		const Hash& hash() const {return _hash;}
+
+		void close() {_close();}
+		virtual void _close() {}
+
+		void error(const char*, ...) {}
+		void warning(const char*, ...) {}
+
+	private:
+		std::vector<Op*> _inputs;
+		KnobList knob_list;
+		bool knobs_created = false;
+		Hash _hash;
+
+		void createKnobs();
+};
+
+
+}
+}
@@ -0,0 +1,6 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+//the plugins include it, but only use what the other stand-in headers declare
+#pragma once
+
+#include "DeepOp.h"
+#include "Iop.h"
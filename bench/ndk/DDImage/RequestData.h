@@ -0,0 +1,31 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include "Box.h"
+#include "ChannelSet.h"
+
+
+namespace DD {
+namespace Image {
+
+
+class Op;
+class DeepOp;
+
+
+//what an op requests from one of its inputs; the stand-in doesn't plan renders ahead, so it is only kept
+struct RequestData
+{
+	Op* op;
+	DeepOp* deepOp;
+	Box box;
+	ChannelSet channels;
+	int count;
+
+	RequestData(Op* input, const Box& b, const ChannelSet& c, int n) : op(input), deepOp(0), box(b), channels(c), count(n) {}
+	RequestData(DeepOp* input, const Box& b, const ChannelSet& c, int n) : op(0), deepOp(input), box(b), channels(c), count(n) {}
+};
+
+
+}
+}
@@ -0,0 +1,35 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <vector>
+#include "ChannelSet.h"
+
+
+namespace DD {
+namespace Image {
+
+
+//one row of a flat image from x to r, for each channel
+class Row
+{
+	private:
+		int _x, _r;
+		std::vector<float> values[Chan_Last + 1];
+
+	public:
+		Row(int x, int r) : _x(x), _r(r) {}
+
+		float* writable(Channel z)
+		{
+			if (values[z].empty())
+				values[z].assign(_r - _x, 0.0f);
+
+			return values[z].data() - _x;
+		}
+
+		const float* operator[](Channel z) const {return const_cast<Row*>(this)->writable(z);}
+};
+
+
+}
+}
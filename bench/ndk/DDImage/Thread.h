@@ -0,0 +1,47 @@
+//stand-in for the Nuke NDK header of the same name, see bench/README.md
+#pragma once
+
+#include <mutex>
+
+
+namespace DD {
+namespace Image {
+
+
+class Lock
+{
+	private:
+		std::mutex mutex;
+
+	public:
+		void lock() {mutex.lock();}
+		void unlock() {mutex.unlock();}
+};
+
+
+class Guard
+{
+	private:
+		Lock& guarded;
+
+	public:
+		Guard(Lock& lock) : guarded(lock) {guarded.lock();}
+		~Guard() {guarded.unlock();}
+};
+
+
+class Thread
+{
+	public:
+		typedef void ThreadFunction(unsigned index, unsigned threads, void* data);
+
+		static unsigned numThreads;			//number of cores
+
+		//starts "threads" threads calling function(index, threads, data); wait(data) returns once all of them are done
+		static void spawn(ThreadFunction* function, int threads, void* data);
+		static void wait(void* data);
+};
+
+
+}
+}
@@ -15,6 +15,9 @@ static const char* const HELP =	"Performs a Gaussian blur on Deep images. Be car
 								"Author: Mark Spindler\n"
 								"Contact: info@mark-spindler.com";
 
+static const char* const modes[] = {"exact", "separable", "sliding window", 0};
+static const char* const slicings[] = {"adaptive", "uniform", 0};
+
 
 #include <numeric>
 #include <math.h>
@@ -32,21 +35,67 @@ using namespace DD::Image;
 
 
 
+//pixels of a blur kernel as offsets from its center, together with their normalized weights
+struct KernelTaps
+{
+	std::vector<int> x;
+	std::vector<int> y;
+	std::vector<float> weight;
+
+	void clear()
+	{
+		x.clear();
+		y.clear();
+		weight.clear();
+	}
+};
+
+
 class msDeepBlur : public DeepOnlyOp
 {
 	private:
 		float _size[2];
+		int _mode;
+		float _prune;
 		bool _drop_hidden;
 		bool _drop_transparent;
 		float _threshold;
+		float _opacity_cutoff;
+		bool _consolidate;
+		float _depth_tolerance;
+		float _alpha_error;
+		int _max_samples;
 		bool _volumetric;
 		bool _fast_blur;
+		int _slices;
+		int _slicing;
+		float _slice_near;
+		float _slice_far;
+		int _max_threads;
+		int _cache_memory;
+		const char* _stats_text;
+		const char* _stats_file;
 
 		int kernel_radius[2];
 		int kernel_dimensions[2];
 		int amount;
 		float sigma[2];
 
+		KernelTaps kernel;					//kernel of the exact mode
+		KernelTaps kernel_horizontal;		//kernels of the two passes of the separable and sliding window modes
+		KernelTaps kernel_vertical;
+		int footprint[2];					//how far the remaining taps reach out from the kernel center, i.e. how much the input box needs to be extended
+
+		std::vector<float> adaptive_boundaries;		//depths between the adaptive slices of the fast blur, the same for all boxes
+		Hash adaptive_hash;							//hash of the op when they were calculated
+		Lock adaptive_lock;							//only guards the two above, the input is read without holding it
+
+		DeepTileCache tile_cache;
+		DeepStats stats;
+
+		enum {exact, separable, sliding_window};
+		enum {adaptive, uniform};
+
 	public:
 		int minimum_inputs() const {return 1;}
 		int maximum_inputs() const {return 1;}
@@ -54,19 +103,42 @@ class msDeepBlur : public DeepOnlyOp
 		msDeepBlur(Node* node) : DeepOnlyOp(node)
 		{
 			_size [0] = _size[1] = 0;
+			_mode = exact;
+			_prune = 0;
 			_drop_hidden = true;
 			_drop_transparent = true;
 			_threshold = 0;
+			_opacity_cutoff = 1;
+			_consolidate = false;
+			_depth_tolerance = 0;
+			_alpha_error = 0;
+			_max_samples = 0;
 			_volumetric = true;
 			_fast_blur = false;
+			_slices = 16;
+			_slicing = adaptive;
+			_slice_near = 0;
+			_slice_far = 1000;
+			_max_threads = 1;
+			_cache_memory = 0;
+			_stats_text = 0;
+			_stats_file = 0;
 		}
 	
 		virtual void knobs(Knob_Callback);
 		int knob_changed(Knob*);
 		bool test_input(int, Op*) const;
 		void _validate(bool);
+		void _close();
 		virtual void getDeepRequests(Box, const ChannelSet&, int, std::vector<RequestData>&);
+		void calculateKernel();
 		virtual bool doDeepEngine(Box, const ChannelSet&, DeepOutputPlane&);
+		void blurExact(DeepPlane&, Box, const ChannelSet&, DeepOutputPlane&, DeepTile*);
+		void blurSeparable(DeepPlane&, Box, const ChannelSet&, DeepOutputPlane&, DeepTile*);
+		void blurSlidingWindow(DeepPlane&, Box, const ChannelSet&, DeepOutputPlane&, DeepTile*);
+		void sliceGrid(Box&, int&, int&);
+		bool sliceBoundaries(std::vector<float>&);
+		void blurSliced(DeepPlane&, Box, const ChannelSet&, const std::vector<float>&, DeepOutputPlane&, DeepTile*);
 		
 		DeepOp* input0() {return dynamic_cast<DeepOp*>(Op::input(0));}
 	
@@ -86,6 +158,39 @@ void msDeepBlur::knobs(Knob_Callback f)
 	WH_knob(f, _size, "size");
 	SetRange(f, 0, 5);
 
+	Enumeration_knob(f, &_mode, modes, "mode", "mode");
+	Tooltip(f,	"exact: merge all pixels of the blur kernel at once for every output pixel.\n\n"
+				"separable: merge each row of the kernel into an intermediate Deep image first, then merge its columns. This is much faster for larger sizes. "
+				"The accumulated alpha at every depth is the same as in exact mode, but partly transparent samples get split and recombined differently, so their colors can differ slightly. "
+				"Hidden samples are dropped in both passes. Transparent samples are only dropped by the threshold in the second pass, so the threshold doesn't get applied twice.\n\n"
+				"sliding window: merge each column of the kernel first, then merge those columns for every output pixel. While moving along a row, the merged columns are kept and only the one entering the kernel gets merged, "
+				"so instead of an intermediate image only one kernel width of merged columns needs to be kept in memory. The columns are merged again for every output row though, so this mode is slower than separable mode, and on hard surfaces or with small sizes even slower than exact mode. "
+				"It is meant for large boxes whose intermediate image in separable mode would take too much memory. The result differs from exact mode the same way as separable mode's does.");
+
+	Float_knob(f, &_prune, "prune", "prune weights below");
+	Tooltip(f, "Skip all pixels of the blur kernel whose normalized weight is below this value and renormalize the remaining weights. Each of these pixels costs a full merge of its Deep samples, but small values like 0.001 barely change the result. 0 keeps the full kernel.");
+	SetRange(f, 0, 0.01);
+
+	Bool_knob(f, &_fast_blur, "fast_blur", "fast blur");
+	Tooltip(f,	"Approximate the blur: sort the samples into depth slices, blur each slice like a flat image and rebuild at most one sample per slice for every pixel. "
+				"The render time depends on the number of slices instead of the size of the blur and the number of samples, so large sizes become usable. "
+				"Within a slice, samples get composited and blurred like a flat image, so where objects in the same slice occlude each other, the result differs from the exact and separable modes.");
+	SetFlags(f, Knob::STARTLINE);
+
+	Int_knob(f, &_slices, "slices", "slices");
+	Tooltip(f, "Number of depth slices of the fast blur, i.e. the maximum number of samples of each output pixel. More slices separate objects at different depths better, but take longer to render.");
+	SetRange(f, 1, 64);
+
+	Enumeration_knob(f, &_slicing, slicings, "slicing", "slicing");
+	Tooltip(f,	"adaptive: place the slices so each of them holds about the same number of samples of the input. This adapts to any scene. The slices are placed once for the whole input, from a grid of up to 256 x 256 of its pixels, so all areas of the image use the same slices.\n\n"
+				"uniform: divide the depth range below evenly. Samples in front of or behind the range go to the first or last slice.");
+
+	Float_knob(f, &_slice_near, "slice_near", "depth range");
+	Tooltip(f, "Near and far end of the uniform slices.");
+	ClearFlags(f, Knob::SLIDER);
+	Float_knob(f, &_slice_far, "slice_far", "");
+	ClearFlags(f, Knob::STARTLINE | Knob::SLIDER);
+
 	Divider(f, "");
 	
 	Bool_knob(f, &_drop_hidden, "drop_hidden", "drop hidden samples");
@@ -98,14 +203,75 @@ void msDeepBlur::knobs(Knob_Callback f)
 	Float_knob(f, &_threshold, "threshold", "threshold");
 	Tooltip(f, "If \"drop transparent samples\" is activated, any samples with an alpha value equal or smaller than this threshold will be removed.");
 	SetRange(f, 0, 1);
+
+	Float_knob(f, &_opacity_cutoff, "opacity_cutoff", "opacity cutoff");
+	Tooltip(f, "If \"drop hidden samples\" is activated, the merge of a pixel also ends as soon as its accumulated alpha reaches this value, and its last sample is made opaque to cover the rest. This saves going through all remaining samples of dense hair or volumes, whose accumulated alpha only approaches 1. The alpha of a pixel can change by at most 1 minus this value. At 1, merges only end at opaque samples.");
+	SetRange(f, 0.99, 1);
+
+	Divider(f, "");
+
+	Bool_knob(f, &_consolidate, "consolidate", "consolidate samples");
+	Tooltip(f, "Merge neighbouring output samples, so subsequent Deep nodes have fewer samples to process. The merged samples are composited over each other, so the flattened image stays the same, only the alpha gets distributed over fewer depths.");
+	SetFlags(f, Knob::STARTLINE);
+
+	Float_knob(f, &_depth_tolerance, "depth_tolerance", "depth tolerance");
+	Tooltip(f, "If \"consolidate samples\" is activated, samples whose fronts are no further apart than this distance are merged.");
+	SetRange(f, 0, 1);
+
+	Float_knob(f, &_alpha_error, "alpha_error", "alpha error");
+	Tooltip(f, "If \"consolidate samples\" is activated, neighbouring samples are also merged regardless of their distance, as long as less accumulated alpha than this gets moved to the front of the merged sample. 0 turns this off.");
+	SetRange(f, 0, 0.05);
+
+	Int_knob(f, &_max_samples, "max_samples", "max samples");
+	Tooltip(f, "If \"consolidate samples\" is activated, the neighbours with the least visible sample among them keep getting merged until each pixel has no more than this many samples. 0 means no limit.");
+
+	Divider(f, "");
+
+	Int_knob(f, &_max_threads, "max_threads", "max threads");
+	Tooltip(f, "Maximum number of threads that render the rows of a single requested box in parallel. 1, the default, renders each box on the thread that requested it, as Nuke already renders several boxes at once; more threads mostly help when only a few large boxes are requested, e.g. by a DeepWrite. 0 uses all cores. The result is the same for any number of threads.");
+	SetFlags(f, Knob::STARTLINE);
+
+	Int_knob(f, &_cache_memory, "cache_memory", "cache memory (MB)");
+	Tooltip(f, "Keep up to this much memory of finished boxes, so viewing the same frame again with unchanged inputs and knobs doesn't blur it again. The least recently used boxes are dropped once the limit is reached. 0 turns the cache off.");
+	SetFlags(f, Knob::NO_RERENDER);
+
+	deepStatsKnobs(f, &_stats_text, &_stats_file);
 }
 
 
 int msDeepBlur::knob_changed(Knob* k)
 {
+	if (deepStatsKnobChanged(this, k, stats, &tile_cache, _stats_file))
+		return 1;
+
 	if(k == &Knob::showPanel)
 	{
 		knob("threshold")->enable(_drop_transparent);
+		knob("opacity_cutoff")->enable(_drop_hidden);
+		knob("depth_tolerance")->enable(_consolidate);
+		knob("alpha_error")->enable(_consolidate);
+		knob("max_samples")->enable(_consolidate);
+		knob("mode")->enable(!_fast_blur);
+		knob("slices")->enable(_fast_blur);
+		knob("slicing")->enable(_fast_blur);
+		knob("slice_near")->enable(_fast_blur && (_slicing == uniform));
+		knob("slice_far")->enable(_fast_blur && (_slicing == uniform));
+		return 1;
+	}
+
+	if(k->is("fast_blur") || k->is("slicing"))
+	{
+		knob("mode")->enable(!_fast_blur);
+		knob("slices")->enable(_fast_blur);
+		knob("slicing")->enable(_fast_blur);
+		knob("slice_near")->enable(_fast_blur && (_slicing == uniform));
+		knob("slice_far")->enable(_fast_blur && (_slicing == uniform));
+		return 1;
+	}
+
+	if(k->is("drop_hidden"))
+	{
+		knob("opacity_cutoff")->enable(_drop_hidden);
 		return 1;
 	}
 
@@ -114,6 +280,16 @@ int msDeepBlur::knob_changed(Knob* k)
 		knob("threshold")->enable(_drop_transparent);
 		return 1;
 	}
+
+	if(k->is("consolidate"))
+	{
+		knob("depth_tolerance")->enable(_consolidate);
+		knob("alpha_error")->enable(_consolidate);
+		knob("max_samples")->enable(_consolidate);
+		return 1;
+	}
+
+	return 0;
 }
 
 
@@ -129,45 +305,52 @@ void msDeepBlur::_validate(bool for_real)
 	{
 		input0()->validate(for_real);
 		_deepInfo = input0()->deepInfo();
+
+		calculateKernel();
 	}
 
 	else
 		_deepInfo = DeepInfo();
+
+	tile_cache.setBudget((size_t)std::max(_cache_memory, 0) << 20);
 }
 
 
-void msDeepBlur::getDeepRequests(Box box, const ChannelSet& channels, int count, std::vector<RequestData>& requests)
+void msDeepBlur::_close()
 {
-	kernel_radius[0] = std::floor(std::abs(_size[0]) * 1.5f);		//approximation of the relation between size and kernel dimensions in Nuke's Blur node
-	kernel_radius[1] = std::floor(std::abs(_size[1]) * 1.5f);
-	kernel_dimensions[0] = kernel_radius[0] * 2 + 1;
-	kernel_dimensions[1] = kernel_radius[1] * 2 + 1;
-	amount = kernel_dimensions[0] * kernel_dimensions[1];
-	sigma[0] = _size[0] * 0.425;									//approximation of the relation between size and sigma in Nuke's Blur node
-	sigma[1] = _size[1] * 0.425;	
+	writeDeepStats(this, stats, &tile_cache, _stats_file);
+}
 
 
+void msDeepBlur::getDeepRequests(Box box, const ChannelSet& channels, int count, std::vector<RequestData>& requests)
+{
 	if (input0())
 	{
 		Box myBox = box;
-		myBox.x(box.x() - kernel_radius[0]);
-		myBox.y(box.y() - kernel_radius[1]);
-		myBox.r(box.r() + kernel_radius[0]);
-		myBox.t(box.t() + kernel_radius[1]);
+		myBox.x(box.x() - footprint[0]);
+		myBox.y(box.y() - footprint[1]);
+		myBox.r(box.r() + footprint[0]);
+		myBox.t(box.t() + footprint[1]);
+
+		requests.push_back(RequestData(input0(), myBox, deepWorkingChannels(channels), count));
 
-		requests.push_back(RequestData(input0(), myBox, channels, count));
+		//the rows the adaptive slices are taken from
+		if (_fast_blur && (_slicing == adaptive))
+		{
+			Box bbox;
+			int step_x, step_y;
+			sliceGrid(bbox, step_x, step_y);
+
+			for (int y = bbox.y(); y < bbox.t(); y += step_y)
+				requests.push_back(RequestData(input0(), Box(bbox.x(), y, bbox.r(), y + 1), Mask_Deep, count));
+		}
 	}
 }
 
 
-void calculateGaussianMatrix(int kernel_radius[2], float sigma[2], float weight[])
-{	
-	int amount = (kernel_radius[0] * 2 + 1) * (kernel_radius[1] * 2 + 1);
-	float* weight_horizontal = new float[kernel_radius[0] + 1];
-	float* weight_vertical = new float[kernel_radius[1] + 1];
-	float weight_sum = 0;
-	int counter = 0;
-
+//calculates one side of the Gaussian kernel for both axes, from the center (index 0) to the kernel radius
+void calculateGaussianWeights(int kernel_radius[2], float sigma[2], float weight_horizontal[], float weight_vertical[])
+{
 	//calculate horizontal weights
 	for (int i = 0; i <= kernel_radius[0]; i++)
 	{
@@ -193,6 +376,18 @@ void calculateGaussianMatrix(int kernel_radius[2], float sigma[2], float weight[
 				weight_vertical[j] = std::exp((-1.0f)*(j*j) / (2 * sigma[1]*sigma[1])) / std::sqrt(3.14159265358979f * 2 * sigma[1]*sigma[1]);
 		}
 	}
+}
+
+
+void calculateGaussianMatrix(int kernel_radius[2], float sigma[2], float weight[])
+{	
+	int amount = (kernel_radius[0] * 2 + 1) * (kernel_radius[1] * 2 + 1);
+	float* weight_horizontal = new float[kernel_radius[0] + 1];
+	float* weight_vertical = new float[kernel_radius[1] + 1];
+	float weight_sum = 0;
+	int counter = 0;
+
+	calculateGaussianWeights(kernel_radius, sigma, weight_horizontal, weight_vertical);
 
 	//combine horizontal and vertical weights
 	for (int i = -kernel_radius[0]; i <= kernel_radius[0]; i++)
@@ -218,56 +413,671 @@ void calculateGaussianMatrix(int kernel_radius[2], float sigma[2], float weight[
 }
 
 
+//calculates the full horizontal and vertical kernels (2 * kernel_radius + 1 entries each) for the separable blur, each normalized so its sum equals 1
+void calculateGaussianVectors(int kernel_radius[2], float sigma[2], float weight_horizontal[], float weight_vertical[])
+{
+	float* side_horizontal = new float[kernel_radius[0] + 1];
+	float* side_vertical = new float[kernel_radius[1] + 1];
+	float weight_sum[2] = {0, 0};
+
+	calculateGaussianWeights(kernel_radius, sigma, side_horizontal, side_vertical);
+
+	for (int i = -kernel_radius[0]; i <= kernel_radius[0]; i++)
+	{
+		weight_horizontal[i + kernel_radius[0]] = side_horizontal[std::abs(i)];
+		weight_sum[0] += side_horizontal[std::abs(i)];
+	}
+
+	for (int j = -kernel_radius[1]; j <= kernel_radius[1]; j++)
+	{
+		weight_vertical[j + kernel_radius[1]] = side_vertical[std::abs(j)];
+		weight_sum[1] += side_vertical[std::abs(j)];
+	}
+
+	for (int i = 0; i < kernel_radius[0] * 2 + 1; i++)
+		weight_horizontal[i] /= weight_sum[0];
+
+	for (int j = 0; j < kernel_radius[1] * 2 + 1; j++)
+		weight_vertical[j] /= weight_sum[1];
+
+
+	delete[] side_horizontal;
+	delete[] side_vertical;
+}
+
+
+//removes all taps whose weight is below epsilon (except for the center) and renormalizes the remaining weights, so their sum equals 1
+void pruneKernelTaps(KernelTaps& taps, float epsilon)
+{
+	if (epsilon <= 0)
+		return;
+
+	size_t kept = 0;
+	float weight_sum = 0;
+
+	for (size_t i = 0; i < taps.weight.size(); i++)
+	{
+		if ((taps.weight[i] >= epsilon) || ((taps.x[i] == 0) && (taps.y[i] == 0)))
+		{
+			taps.x[kept] = taps.x[i];
+			taps.y[kept] = taps.y[i];
+			taps.weight[kept] = taps.weight[i];
+			weight_sum += taps.weight[i];
+
+			kept++;
+		}
+	}
+
+	taps.x.resize(kept);
+	taps.y.resize(kept);
+	taps.weight.resize(kept);
+
+	weight_sum = 1 / weight_sum;
+	for (size_t i = 0; i < kept; i++)
+		taps.weight[i] *= weight_sum;
+}
+
+
+//the kernel only depends on the knobs, so it is built once here and shared by all calls of doDeepEngine
+void msDeepBlur::calculateKernel()
+{
+	kernel_radius[0] = std::floor(std::abs(_size[0]) * 1.5f);		//approximation of the relation between size and kernel dimensions in Nuke's Blur node
+	kernel_radius[1] = std::floor(std::abs(_size[1]) * 1.5f);
+	kernel_dimensions[0] = kernel_radius[0] * 2 + 1;
+	kernel_dimensions[1] = kernel_radius[1] * 2 + 1;
+	amount = kernel_dimensions[0] * kernel_dimensions[1];
+	sigma[0] = _size[0] * 0.425;									//approximation of the relation between size and sigma in Nuke's Blur node
+	sigma[1] = _size[1] * 0.425;
+
+	kernel.clear();
+	kernel_horizontal.clear();
+	kernel_vertical.clear();
+	footprint[0] = footprint[1] = 0;
+
+	if ((_mode == separable) || (_mode == sliding_window) || _fast_blur)
+	{
+		kernel_horizontal.weight.resize(kernel_dimensions[0]);
+		kernel_vertical.weight.resize(kernel_dimensions[1]);
+		calculateGaussianVectors(kernel_radius, sigma, &kernel_horizontal.weight[0], &kernel_vertical.weight[0]);
+
+		for (int i = -kernel_radius[0]; i <= kernel_radius[0]; i++)
+		{
+			kernel_horizontal.x.push_back(i);
+			kernel_horizontal.y.push_back(0);
+		}
+
+		for (int j = -kernel_radius[1]; j <= kernel_radius[1]; j++)
+		{
+			kernel_vertical.x.push_back(0);
+			kernel_vertical.y.push_back(j);
+		}
+
+		pruneKernelTaps(kernel_horizontal, _prune);
+		pruneKernelTaps(kernel_vertical, _prune);
+
+		for (size_t i = 0; i < kernel_horizontal.x.size(); i++)
+			footprint[0] = std::max(footprint[0], std::abs(kernel_horizontal.x[i]));
+
+		for (size_t j = 0; j < kernel_vertical.y.size(); j++)
+			footprint[1] = std::max(footprint[1], std::abs(kernel_vertical.y[j]));
+	}
+
+	else
+	{
+		kernel.weight.resize(amount);
+		calculateGaussianMatrix(kernel_radius, sigma, &kernel.weight[0]);
+
+		for (int i = -kernel_radius[0]; i <= kernel_radius[0]; i++)		//same order as the weights of calculateGaussianMatrix
+		{
+			for (int j = -kernel_radius[1]; j <= kernel_radius[1]; j++)
+			{
+				kernel.x.push_back(i);
+				kernel.y.push_back(j);
+			}
+		}
+
+		pruneKernelTaps(kernel, _prune);
+		amount = kernel.weight.size();
+
+		for (int k = 0; k < amount; k++)
+		{
+			footprint[0] = std::max(footprint[0], std::abs(kernel.x[k]));
+			footprint[1] = std::max(footprint[1], std::abs(kernel.y[k]));
+		}
+	}
+}
+
+
 bool msDeepBlur::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
 {
 	if (!input0())
 		return false;
 
+	if (tile_cache.find(hash(), box, channels, outPlane))
+		return true;
+
+	std::vector<float> boundaries;
+	if (_fast_blur && !sliceBoundaries(boundaries))
+		return false;
+
 	DeepPlane inPlane;
 
 	Box myBox = box;
-	myBox.x(box.x() - kernel_radius[0]);
-	myBox.y(box.y() - kernel_radius[1]);
-	myBox.r(box.r() + kernel_radius[0]);
-	myBox.t(box.t() + kernel_radius[1]);
+	myBox.x(box.x() - footprint[0]);
+	myBox.y(box.y() - footprint[1]);
+	myBox.r(box.r() + footprint[0]);
+	myBox.t(box.t() + footprint[1]);
 
-	if (!input0()->deepEngine(myBox, channels, inPlane))
+	if (!input0()->deepEngine(myBox, deepWorkingChannels(channels), inPlane))
 		return false;
 
-	//calculate weights for Gaussian Blur
-	float* weight = new float[amount];
-	calculateGaussianMatrix(kernel_radius, sigma, weight);
-
-	
-	//cycle through all pixels and calculate outcome 
+	DeepStatsScope stats_scope(stats, channels);
 	outPlane = DeepOutputPlane(channels, box);
 
-	for (int y = box.y(); y < box.t(); y++)
+	DeepTile tile;
+	DeepTile* record = tile_cache.enabled() ? &tile : 0;
+
+	if (_fast_blur)
+		blurSliced(inPlane, box, channels, boundaries, outPlane, record);
+
+	else if (_mode == separable)
+		blurSeparable(inPlane, box, channels, outPlane, record);
+
+	else if (_mode == sliding_window)
+		blurSlidingWindow(inPlane, box, channels, outPlane, record);
+
+	else
+		blurExact(inPlane, box, channels, outPlane, record);
+
+	tile_cache.insert(hash(), box, channels, tile);
+
+	return true;
+}
+
+
+void msDeepBlur::blurExact(DeepPlane& inPlane, Box box, const ChannelSet& channels, DeepOutputPlane& outPlane, DeepTile* record)
+{
+	//gather all input samples once, then find the pixels in convolve area by their position in the arena
+	DeepScratch& scratch = threadScratch();
+	DeepSampleArena& arena = scratch.arena;
+	gatherDeepSamples(inPlane, channels, arena, scratch.counters);
+
+	resizeScratch(scratch.tap_offset, amount, scratch.counters.allocations);
+	const size_t* tap_offset = &scratch.tap_offset[0];
+	for (int k = 0; k < amount; k++)
+		scratch.tap_offset[k] = kernel.y[k] * arena.box.w() + kernel.x[k];			//negative offsets wrap around, which still adds up to the right pixel
+
+	DeepConsolidation consolidation(channels, _consolidate, _depth_tolerance, _alpha_error, _max_samples);
+
+	//cycle through all pixels and calculate outcome, in bands of rows that can be rendered in parallel
+	auto render = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
+	{
+		DeepScratch& band_scratch = threadScratch();
+		resizeScratch(band_scratch.footprint, amount, band_scratch.counters.allocations);
+		size_t* footprint_pixels = &band_scratch.footprint[0];
+		DeepArenaSource source(arena);
+		source.pixels = footprint_pixels;
+
+		for (int y = y_begin; y < y_end; y++)
+		{
+			for (int x = box.x(); x < box.r(); x++)
+			{	
+				size_t center = arena.pixel(y, x);
+
+				for (int k = 0; k < amount; k++)
+					footprint_pixels[k] = center + tap_offset[k];
+
+				//combine pixels in convolve area
+				DeepOutPixel& outPixel = *outPixels++;
+				outPixel.clear();
+				mergeDeepSamples(source, outPixel, channels, amount, &kernel.weight[0], _drop_hidden, _drop_transparent, _threshold, _opacity_cutoff);
+				consolidateDeepSamples(outPixel, consolidation);
+			}
+		}
+	};
+
+	renderDeepRows(box, _max_threads, render, outPlane, record);
+}
+
+
+void msDeepBlur::blurSeparable(DeepPlane& inPlane, Box box, const ChannelSet& channels, DeepOutputPlane& outPlane, DeepTile* record)
+{
+	int taps_horizontal = kernel_horizontal.weight.size();
+	int taps_vertical = kernel_vertical.weight.size();
+
+	//horizontal pass: combine each pixel with its neighbours in the same row into an intermediate Deep image, which is extended by the vertical footprint at the top and bottom
+	//the intermediate keeps depth and alpha even if they are not requested, as the vertical pass merges by them
+	ChannelSet working = deepWorkingChannels(channels);
+	int width = box.w();
+	int bottom = box.y() - footprint[1];
+	DeepScratch& scratch = threadScratch();
+	std::vector<DeepOutPixel>& intermediate = scratch.pixels;
+	resizeScratch(intermediate, width * (box.h() + footprint[1] * 2), scratch.counters.allocations);
+
+	DeepSampleArena& arena = scratch.arena;
+	gatherDeepSamples(inPlane, working, arena, scratch.counters);
+
+	auto horizontal = [&](int y_begin, int y_end)
+	{
+		DeepScratch& band_scratch = threadScratch();
+		resizeScratch(band_scratch.footprint, taps_horizontal, band_scratch.counters.allocations);
+		size_t* row_pixels = &band_scratch.footprint[0];
+		DeepArenaSource row(arena);
+		row.pixels = row_pixels;
+
+		for (int y = y_begin; y < y_end; y++)
+		{
+			for (int x = box.x(); x < box.r(); x++)
+			{
+				size_t center = arena.pixel(y, x);
+
+				for (int k = 0; k < taps_horizontal; k++)
+					row_pixels[k] = center + kernel_horizontal.x[k];
+
+				DeepOutPixel& outPixel = intermediate[(y - bottom) * width + x - box.x()];
+				size_t capacity = outPixel.capacity();
+				outPixel.clear();
+				mergeDeepSamples(row, outPixel, working, taps_horizontal, &kernel_horizontal.weight[0], _drop_hidden, _drop_transparent, 0);		//threshold is only applied in the vertical pass
+				band_scratch.counters.allocations += outPixel.capacity() > capacity;
+			}
+		}
+	};
+
+	forEachDeepBand(bottom, box.t() + footprint[1], _max_threads, horizontal);
+
+	//vertical pass: combine the intermediate pixels of each column and output the result
+	DeepConsolidation consolidation(channels, _consolidate, _depth_tolerance, _alpha_error, _max_samples);
+
+	auto vertical = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
+	{
+		DeepScratch& band_scratch = threadScratch();
+		DeepOutPixelSource& source = band_scratch.merged;
+		source.assign(working, channels, taps_vertical, band_scratch.counters.allocations);
+		DeepOutPixel** column = &source.pixels[0];
+
+		for (int y = y_begin; y < y_end; y++)
+		{
+			for (int x = box.x(); x < box.r(); x++)
+			{
+				for (int k = 0; k < taps_vertical; k++)
+					column[k] = &intermediate[(y + kernel_vertical.y[k] - bottom) * width + x - box.x()];
+
+				DeepOutPixel& outPixel = *outPixels++;
+				outPixel.clear();
+				mergeDeepSamples(source, outPixel, channels, taps_vertical, &kernel_vertical.weight[0], _drop_hidden, _drop_transparent, _threshold, _opacity_cutoff);
+				consolidateDeepSamples(outPixel, consolidation);
+			}
+		}
+	};
+
+	renderDeepRows(box, _max_threads, vertical, outPlane, record);
+}
+
+
+//sliding window: for each output row, the columns of the kernel are merged first (vertical pass) into a ring buffer that holds one kernel width of them;
+//moving on to the next pixel only evicts the column that leaves the kernel and merges the one that enters it, and each output pixel is the merge of the columns in the ring (horizontal pass)
+//the columns can't be carried over to the next row: their taps get other weights there, and a merge can't take a pixel out again. So each input pixel is merged once per vertical tap, which is more work than separable mode and only saves its intermediate image
+void msDeepBlur::blurSlidingWindow(DeepPlane& inPlane, Box box, const ChannelSet& channels, DeepOutputPlane& outPlane, DeepTile* record)
+{
+	//the merged columns keep depth and alpha even if they are not requested, as the horizontal pass merges by them
+	ChannelSet working = deepWorkingChannels(channels);
+	DeepScratch& scratch = threadScratch();
+	DeepSampleArena& arena = scratch.arena;
+	gatherDeepSamples(inPlane, working, arena, scratch.counters);
+
+	DeepConsolidation consolidation(channels, _consolidate, _depth_tolerance, _alpha_error, _max_samples);
+	int taps_horizontal = kernel_horizontal.weight.size();
+	int taps_vertical = kernel_vertical.weight.size();
+	int window = footprint[0] * 2 + 1;
+
+	auto render = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
 	{
-		for (int x = box.x(); x < box.r(); x++)
-		{	
-			//cycle through pixels in convolve area and add them to vector inPixels
-			std::vector<DeepPixel> inPixels;
+		DeepScratch& band_scratch = threadScratch();
+		std::vector<DeepOutPixel>& columns = band_scratch.pixels;			//merged columns, column x is kept at (x - box.x() + window) % window
+		if (columns.size() < (size_t)window)
+			resizeScratch(columns, window, band_scratch.counters.allocations);
+
+		resizeScratch(band_scratch.footprint, taps_vertical, band_scratch.counters.allocations);
+		size_t* column_pixels = &band_scratch.footprint[0];
+		DeepArenaSource column(arena);
+		column.pixels = column_pixels;
 
-			for (int i = -kernel_radius[0]; i <= kernel_radius[0]; i++)
+		DeepOutPixelSource& source = band_scratch.merged;
+		source.assign(working, channels, taps_horizontal, band_scratch.counters.allocations);
+		DeepOutPixel** row = &source.pixels[0];
+
+		for (int y = y_begin; y < y_end; y++)
+		{
+			for (int x = box.x() - footprint[0]; x < box.r() + footprint[0]; x++)
 			{
-				for (int j = -kernel_radius[1]; j <= kernel_radius[1]; j++)
+				//vertical pass: merge the column entering the kernel, in place of the one that has just left it
+				size_t center = arena.pixel(y, x);
+
+				for (int k = 0; k < taps_vertical; k++)
+					column_pixels[k] = center + kernel_vertical.y[k] * arena.box.w();
+
+				DeepOutPixel& merged = columns[(x - box.x() + window) % window];
+				size_t capacity = merged.capacity();
+				merged.clear();
+				mergeDeepSamples(column, merged, working, taps_vertical, &kernel_vertical.weight[0], _drop_hidden, _drop_transparent, 0);		//threshold is only applied in the horizontal pass
+				band_scratch.counters.allocations += merged.capacity() > capacity;
+
+				//horizontal pass: once the ring holds all columns of the kernel around x - footprint[0], merge them into the output pixel
+				int out_x = x - footprint[0];
+				if (out_x < box.x())
+					continue;
+
+				for (int k = 0; k < taps_horizontal; k++)
+					row[k] = &columns[(out_x + kernel_horizontal.x[k] - box.x() + window) % window];
+
+				DeepOutPixel& outPixel = *outPixels++;
+				outPixel.clear();
+				mergeDeepSamples(source, outPixel, channels, taps_horizontal, &kernel_horizontal.weight[0], _drop_hidden, _drop_transparent, _threshold, _opacity_cutoff);
+				consolidateDeepSamples(outPixel, consolidation);
+			}
+		}
+	};
+
+	renderDeepRows(box, _max_threads, render, outPlane, record);
+}
+
+
+//the input pixels the adaptive slices are taken from: every step_x-th pixel of every step_y-th row of the input box, at most slice_grid x slice_grid of them, so large inputs don't need to be rendered entirely
+void msDeepBlur::sliceGrid(Box& bbox, int& step_x, int& step_y)
+{
+	const int slice_grid = 256;
+	bbox = input0()->deepInfo().box();
+	step_x = std::max((bbox.w() + slice_grid - 1) / slice_grid, 1);
+	step_y = std::max((bbox.h() + slice_grid - 1) / slice_grid, 1);
+}
+
+
+//depths between the slices of the fast blur: evenly spaced in the depth range, or at the quantiles of the front depths of the input
+//the adaptive ones must not depend on the requested box, or neighbouring boxes would slice differently and show seams, so they are taken from the grid of sliceGrid once per hash;
+//the grid is read without holding adaptive_lock, so other threads don't wait on the input. Threads that miss the stored boundaries at the same time calculate the same ones
+bool msDeepBlur::sliceBoundaries(std::vector<float>& boundaries)
+{
+	int slices = std::max(_slices, 1);
+	boundaries.assign(slices - 1, 0.0f);
+
+	if (_slicing == uniform)
+	{
+		for (int i = 1; i < slices; i++)
+			boundaries[i - 1] = _slice_near + (_slice_far - _slice_near) * i / slices;
+
+		return true;
+	}
+
+	{
+		Guard guard(adaptive_lock);
+
+		if ((adaptive_hash == hash()) && (adaptive_boundaries.size() == boundaries.size()))
+		{
+			boundaries = adaptive_boundaries;
+			return true;
+		}
+	}
+
+	Box bbox;
+	int step_x, step_y;
+	sliceGrid(bbox, step_x, step_y);
+	std::vector<float> depths;
+
+	for (int y = bbox.y(); y < bbox.t(); y += step_y)
+	{
+		DeepPlane row;
+
+		if (!input0()->deepEngine(Box(bbox.x(), y, bbox.r(), y + 1), Mask_Deep, row))
+			return false;
+
+		for (int x = bbox.x(); x < bbox.r(); x += step_x)
+		{
+			DeepPixel pixel = row.getPixel(y, x);
+
+			for (size_t s = 0; s < pixel.getSampleCount(); s++)
+				depths.push_back(pixel.getUnorderedSample(s, Chan_DeepFront));
+		}
+	}
+
+	size_t previous = 0;
+
+	for (int i = 1; (i < slices) && !depths.empty(); i++)
+	{
+		size_t quantile = depths.size() * i / slices;
+		std::nth_element(depths.begin() + previous, depths.begin() + quantile, depths.end());
+		boundaries[i - 1] = depths[quantile];
+		previous = quantile;
+	}
+
+	Guard guard(adaptive_lock);
+	adaptive_boundaries = boundaries;
+	adaptive_hash = hash();
+	return true;
+}
+
+
+//fast blur: sorts the samples into depth slices, blurs each slice like a flat image with the separable kernels and rebuilds one sample per slice for each pixel
+//each slice consists of the visible (i.e. premultiplied and attenuated by all closer samples) channels of its samples, the accumulated alpha up to its end, the depths of its closest front and furthest back,
+//and a presence image (1 wherever the slice has samples), which the depths get divided by after blurring
+//like in the exact mode, the accumulated alpha of the output at the end of each slice is the weighted average of the input's, and the flattened result equals the blurred flat image
+void msDeepBlur::blurSliced(DeepPlane& inPlane, Box box, const ChannelSet& channels, const std::vector<float>& boundaries, DeepOutputPlane& outPlane, DeepTile* record)
+{
+	DeepScratch& scratch = threadScratch();
+	DeepSampleArena& arena = scratch.arena;
+	gatherDeepSamples(inPlane, channels, arena, scratch.counters);
+	int slices = boundaries.size() + 1;
+
+	//as the samples of each pixel are sorted by depth, so are their slices
+	resizeScratch(scratch.slice_index, arena.sample_total, scratch.counters.allocations);
+	int* slice_index = arena.sample_total > 0 ? &scratch.slice_index[0] : 0;
+
+	for (size_t n = 0; n < arena.sample_total; n++)
+		slice_index[n] = std::upper_bound(boundaries.begin(), boundaries.end(), arena.front[n]) - boundaries.begin();
+
+	//images of each slice: all output channels, then the accumulated alpha and the presence of samples
+	int channel_count = channels.size();
+	int alpha_image = channel_count;
+	int presence_image = channel_count + 1;
+	int image_count = channel_count + 2;
+	int front_channel = -1;
+	int back_channel = -1;
+	std::vector<int> blurred_images;			//images that carry any information; missing channels stay 0
+
+	int channel = 0;
+	foreach (z, channels)
+	{
+		if (z == Chan_DeepFront)
+			front_channel = channel;
+		else if (z == Chan_DeepBack)
+			back_channel = channel;
+
+		if (arena.scaled[channel] || (z == Chan_DeepFront) || (z == Chan_DeepBack))
+			blurred_images.push_back(channel);
+
+		channel++;
+	}
+
+	blurred_images.push_back(alpha_image);
+	blurred_images.push_back(presence_image);
+
+	DeepConsolidation consolidation(channels, _consolidate, _depth_tolerance, _alpha_error, _max_samples);
+	int taps_horizontal = kernel_horizontal.weight.size();
+	int taps_vertical = kernel_vertical.weight.size();
+	int width = box.w();
+
+	auto render = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
+	{
+		DeepScratch& band_scratch = threadScratch();
+		int rows = y_end - y_begin;
+		int in_width = width + footprint[0] * 2;
+		int in_rows = rows + footprint[1] * 2;
+		size_t in_area = in_width * in_rows;						//slice images of the band, extended by the footprint
+		size_t row_area = width * in_rows;							//after the horizontal pass
+		size_t out_area = width * rows;								//after the vertical pass
+
+		resizeScratch(band_scratch.slice_image, in_area * image_count, band_scratch.counters.allocations);
+		resizeScratch(band_scratch.slice_rows, row_area * image_count, band_scratch.counters.allocations);
+		resizeScratch(band_scratch.slice_blurred, out_area * image_count, band_scratch.counters.allocations);
+		resizeScratch(band_scratch.slice_cursor, in_area, band_scratch.counters.allocations);
+		resizeScratch(band_scratch.slice_done, out_area, band_scratch.counters.allocations);
+		resizeScratch(band_scratch.slice_alpha_accum, out_area, band_scratch.counters.allocations);
+		float* image = &band_scratch.slice_image[0];
+		float* image_rows = &band_scratch.slice_rows[0];
+		float* blurred = &band_scratch.slice_blurred[0];
+		size_t* cursor = &band_scratch.slice_cursor[0];				//next sample of each input pixel
+		unsigned char* done = &band_scratch.slice_done[0];			//whether an output pixel is already opaque
+		float* alpha_accum = &band_scratch.slice_alpha_accum[0];		//accumulated alpha of each output pixel up to the previous slice
+		float* input_alpha_accum = image + alpha_image * in_area;		//accumulated alpha of each input pixel, carried on from slice to slice
+
+		for (int r = 0; r < in_rows; r++)
+		{
+			size_t p = arena.pixel(y_begin - footprint[1] + r, box.x() - footprint[0]);
+
+			for (int c = 0; c < in_width; c++)
+				cursor[r * in_width + c] = arena.first[p + c];
+		}
+
+		for (size_t i = 0; i < out_area; i++)
+		{
+			outPixels[i].clear();
+			done[i] = 0;
+			alpha_accum[i] = 0;
+		}
+
+		std::fill(input_alpha_accum, input_alpha_accum + in_area, 0.0f);
+
+		for (int slice = 0; slice < slices; slice++)
+		{
+			//add up the visible part of the samples of this slice for each input pixel
+			for (int q = 0; q < image_count; q++)
+			{
+				if (q != alpha_image)
+					std::fill(image + q * in_area, image + (q + 1) * in_area, 0.0f);
+			}
+
+			bool empty = true;
+
+			for (int r = 0; r < in_rows; r++)
+			{
+				size_t p = arena.pixel(y_begin - footprint[1] + r, box.x() - footprint[0]);
+
+				for (int c = 0; c < in_width; c++)
 				{
-					inPixels.push_back(inPlane.getPixel(y + j, x + i));
+					size_t i = r * in_width + c;
+					size_t end = arena.first[p + c + 1];
+					size_t n = cursor[i];
+
+					for (; (n < end) && (slice_index[n] == slice); n++)
+					{
+						float transparency = 1 - input_alpha_accum[i];
+
+						for (int k = 0; k < channel_count; k++)
+						{
+							if (arena.scaled[k])
+								image[k * in_area + i] += arena.data[k * arena.sample_total + n] * transparency;
+						}
+
+						if (image[presence_image * in_area + i] == 0)		//closest sample of the slice
+						{
+							if (front_channel >= 0)
+								image[front_channel * in_area + i] = arena.front[n];
+							if (back_channel >= 0)
+								image[back_channel * in_area + i] = arena.back[n];
+							image[presence_image * in_area + i] = 1;
+						}
+
+						else if (back_channel >= 0)
+							image[back_channel * in_area + i] = std::max(image[back_channel * in_area + i], arena.back[n]);
+
+						input_alpha_accum[i] += arena.alpha[n] * transparency;
+						empty = false;
+					}
+
+					cursor[i] = n;
 				}
 			}
 
-			//combine pixels in convolve area and output the result
-			DeepOutPixel outPixel;
-			outPixel.clear();
-			combineDeepPixels(inPixels, outPixel, channels, amount, weight, _drop_hidden, _drop_transparent, _threshold);
-			outPlane.addPixel(outPixel);
+			if (empty)				//nothing changes for any pixel
+				continue;
+
+			//blur the images horizontally, then vertically
+			for (size_t b = 0; b < blurred_images.size(); b++)
+			{
+				int q = blurred_images[b];
+				std::fill(image_rows + q * row_area, image_rows + (q + 1) * row_area, 0.0f);
+				std::fill(blurred + q * out_area, blurred + (q + 1) * out_area, 0.0f);
+
+				for (int r = 0; r < in_rows; r++)
+				{
+					float* out = image_rows + q * row_area + r * width;
+
+					for (int k = 0; k < taps_horizontal; k++)
+					{
+						const float* in = image + q * in_area + r * in_width + footprint[0] + kernel_horizontal.x[k];
+						float weight = kernel_horizontal.weight[k];
+
+						for (int x = 0; x < width; x++)
+							out[x] += in[x] * weight;
+					}
+				}
+
+				for (int r = 0; r < rows; r++)
+				{
+					float* out = blurred + q * out_area + r * width;
+
+					for (int k = 0; k < taps_vertical; k++)
+					{
+						const float* in = image_rows + q * row_area + (r + footprint[1] + kernel_vertical.y[k]) * width;
+						float weight = kernel_vertical.weight[k];
+
+						for (int x = 0; x < width; x++)
+							out[x] += in[x] * weight;
+					}
+				}
+			}
+
+			//rebuild one sample of this slice for each output pixel, whose alpha raises the accumulated alpha to the blurred one
+			for (size_t i = 0; i < out_area; i++)
+			{
+				float presence = blurred[presence_image * out_area + i];
+				float designated_alpha_accum = blurred[alpha_image * out_area + i];
+				float transparency = 1 - alpha_accum[i];
+				float alpha = transparency > 0 ? std::max(designated_alpha_accum - alpha_accum[i], 0.0f) / transparency : 1;
+				alpha_accum[i] = designated_alpha_accum;
+
+				if (done[i] || (presence <= 0) || (transparency <= 0) || ((alpha <= _threshold) && _drop_transparent))
+					continue;
+
+				DeepOutPixel& outPixel = outPixels[i];
+				size_t offset = outPixel.size();
+				outPixel.resize(offset + channel_count);
+				float* sample = &outPixel[offset];
+
+				for (int k = 0; k < channel_count; k++)
+					sample[k] = arena.scaled[k] ? blurred[k * out_area + i] / transparency : 0;
+
+				if (front_channel >= 0)
+					sample[front_channel] = blurred[front_channel * out_area + i] / presence;
+				if (back_channel >= 0)
+					sample[back_channel] = std::max(blurred[back_channel * out_area + i] / presence, front_channel >= 0 ? sample[front_channel] : 0);
+
+				if ((alpha >= 1) && _drop_hidden)
+					done[i] = 1;
+
+				else if ((designated_alpha_accum >= _opacity_cutoff) && (_opacity_cutoff < 1) && _drop_hidden)
+				{
+					float alpha_error = foldDeepResidual(sample, channels, alpha, designated_alpha_accum);
+					band_scratch.counters.max_alpha_error = std::max(band_scratch.counters.max_alpha_error, alpha_error);
+					done[i] = 1;
+				}
+			}
 		}
-	}
 
-	delete[] weight;
+		for (size_t i = 0; i < out_area; i++)
+			consolidateDeepSamples(outPixels[i], consolidation);
+	};
 
-    return true;
+	renderDeepRows(box, _max_threads, render, outPlane, record);
 }
 
 
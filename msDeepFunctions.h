@@ -13,6 +13,13 @@ To view a copy of this license, visit http://creativecommons.org/licenses/by/3.0
 #include <limits>
 #include <cmath>
 #include <cassert>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <string>
+#include <chrono>
+#include <cstdio>
 #include "DDImage/DeepOp.h"
 #include "DDImage/DeepSample.h"
 #include "DDImage/Filter.h"
@@ -20,6 +27,7 @@ To view a copy of this license, visit http://creativecommons.org/licenses/by/3.0
 #include "DDImage/Knobs.h"
 #include "DDImage/Pixel.h"
 #include "DDImage/RequestData.h"
+#include "DDImage/Thread.h"
 
 
 
@@ -27,23 +35,1121 @@ using namespace DD::Image;
 
 
 
-void combineDeepPixels(std::vector<DeepPixel>& inPixels, DeepOutPixel& outPixel, const ChannelSet& channels, int amount, float weight[], bool drop_hidden = true, bool drop_transparent = true, float transparency_threshold = 0.0f)
+//orders pixel indices by the depth of their next unprocessed sample, so the std heap functions keep the closest one on top; ties resolve to the lower pixel index, i.e. the same pixel a linear scan for the smallest distance would pick
+struct DeepMergeOrder
 {
-	size_t* sampleCount = new size_t[amount];
-	size_t* sampleNo = new size_t[amount];
-	float* distance = new float[amount];
-	float* alpha = new float[amount];
-	float* alpha_accum = new float[amount];
+	const float* distance;
+
+	DeepMergeOrder(const float* distance_list) : distance(distance_list) {}
+
+	bool operator()(int a, int b) const
+	{
+		return (distance[a] > distance[b]) || ((distance[a] == distance[b]) && (a > b));
+	}
+};
+
+
+//sample access for mergeDeepSamples on the pixels of DeepPlanes; sample 0 is the closest sample of a pixel
+//meant to be kept for a whole box, so the channel layout of each input plane only gets resolved once
+struct DeepPixelSource
+{
+	//for each output channel: the input channel to read (Chan_Black if it is missing and needs to be filled with 0) and whether it gets scaled by the new alpha (all channels except depth)
+	struct Layout
+	{
+		const ChannelMap* channel_map;
+		std::vector<Channel> source;
+		std::vector<unsigned char> scaled;
+	};
+
+	const ChannelSet& channels;
+	std::vector<DeepPixel> pixels;
+	std::vector<int> layout;				//index into "layouts" for each pixel
+	std::vector<Layout> layouts;
+
+	DeepPixelSource(const ChannelSet& out_channels) : channels(out_channels) {}
+
+	void clear()
+	{
+		pixels.clear();
+		layout.clear();
+	}
+
+	void push_back(const DeepPixel& pixel)
+	{
+		const ChannelMap* channel_map = &pixel.channels();
+		size_t l = 0;
+
+		while ((l < layouts.size()) && (layouts[l].channel_map != channel_map))
+			l++;
+
+		if (l == layouts.size())
+		{
+			layouts.push_back(Layout());
+			layouts[l].channel_map = channel_map;
+
+			foreach (z, channels)
+			{
+				layouts[l].source.push_back(channel_map->contains(z) ? z : Chan_Black);
+				layouts[l].scaled.push_back(channel_map->contains(z) && (z != Chan_DeepFront) && (z != Chan_DeepBack));
+			}
+		}
+
+		pixels.push_back(pixel);
+		layout.push_back(l);
+	}
+
+	size_t getSampleCount(int i) const {return pixels[i].getSampleCount();}
+	float getDepth(int i, size_t sampleNo) const {return pixels[i].getOrderedSample(pixels[i].getSampleCount() - 1 - sampleNo, Chan_DeepFront);}
+	float getAlpha(int i, size_t sampleNo) const {return pixels[i].getOrderedSample(pixels[i].getSampleCount() - 1 - sampleNo, Chan_Alpha);}
+
+	//writes all output channels of a sample, with all but the depth channels multiplied by "factor"
+	void getChannels(int i, size_t sampleNo, float factor, float* out) const
+	{
+		const DeepPixel& pixel = pixels[i];
+		const Layout& l = layouts[layout[i]];
+		size_t index = pixel.getSampleCount() - 1 - sampleNo;
+		size_t channel_count = l.source.size();
+
+		for (size_t k = 0; k < channel_count; k++)
+		{
+			float value = l.source[k] ? pixel.getOrderedSample(index, l.source[k]) : 0;
+			out[k] = value * (l.scaled[k] ? factor : 1.0f);
+		}
+	}
+};
+
+
+//the channels a merge needs from its inputs: the requested ones plus depth and alpha, which decide how the samples get merged even if they are not requested themselves
+ChannelSet deepWorkingChannels(const ChannelSet& channels)
+{
+	ChannelSet working(channels);
+	working += Mask_Deep;
+	working += Chan_Alpha;
+	return working;
+}
+
+
+//grows a scratch buffer to "size" entries; "allocations" counts how often that actually needed new memory
+template <class T>
+void resizeScratch(std::vector<T>& buffer, size_t size, size_t& allocations)
+{
+	if (buffer.capacity() < size)
+		allocations++;
+
+	buffer.resize(size);
+}
+
+
+//sample access for mergeDeepSamples on pixels previously written by mergeDeepSamples with the channels "in_channels", i.e. with all of them present and samples stored from closest to furthest
+//in_channels have to include depth and alpha (see deepWorkingChannels); only "channels" get written to the output
+//kept in the scratch memory of each thread (see DeepScratch::merged), so assigning it for another band doesn't allocate once its buffers are large enough
+struct DeepOutPixelSource
+{
+	std::vector<DeepOutPixel*> pixels;		//the pixels to merge, set by the caller for each output pixel
+	size_t in_size;
+	size_t front;
+	size_t alpha;
+	std::vector<size_t> source;				//position of each output channel within an input sample
+	std::vector<unsigned char> scaled;
+
+	DeepOutPixelSource() : in_size(0), front(0), alpha(0) {}
+
+	void assign(const ChannelSet& in_channels, const ChannelSet& channels, size_t taps, size_t& allocations)
+	{
+		ChannelMap channel_map(in_channels);
+		in_size = channel_map.size();
+		front = channel_map.chanNo(Chan_DeepFront);
+		alpha = channel_map.chanNo(Chan_Alpha);
+
+		resizeScratch(pixels, taps, allocations);
+		resizeScratch(source, channels.size(), allocations);
+		resizeScratch(scaled, channels.size(), allocations);
+		size_t k = 0;
+
+		foreach (z, channels)
+		{
+			source[k] = channel_map.chanNo(z);
+			scaled[k] = (z != Chan_DeepFront) && (z != Chan_DeepBack);
+			k++;
+		}
+	}
+
+	size_t getSampleCount(int i) const {return pixels[i]->size() / in_size;}
+	float getDepth(int i, size_t sampleNo) const {return (*pixels[i])[sampleNo * in_size + front];}
+	float getAlpha(int i, size_t sampleNo) const {return (*pixels[i])[sampleNo * in_size + alpha];}
+
+	void getChannels(int i, size_t sampleNo, float factor, float* out) const
+	{
+		size_t channel_count = source.size();
+		const float* in = &(*pixels[i])[sampleNo * in_size];
+
+		for (size_t k = 0; k < channel_count; k++)
+			out[k] = in[source[k]] * (scaled[k] ? factor : 1.0f);
+	}
+};
+
+
+//cheap counts of the work done on one thread; they only ever grow, so the work of a call is the difference before and after it, except for max_alpha_error, which is a maximum
+struct DeepCounters
+{
+	size_t input_samples;				//samples read from input planes
+	size_t output_values;				//values (i.e. samples times channels) added to output planes
+	size_t merge_steps;					//samples taken from the heap by mergeDeepSamples
+	size_t early_ends;					//merges that ended at an opaque sample or the opacity cutoff
+	size_t dropped_hidden;				//samples left behind by those merges
+	size_t dropped_transparent;			//samples dropped for being at or below the transparency threshold
+	size_t allocations;					//how often any scratch buffer or reused output pixel had to grow; small per-box bookkeeping like channel layouts isn't counted
+	size_t samples_saved;				//how many output samples consolidateDeepSamples removed
+	size_t releases;					//how often a thread gave back its scratch memory after a box, for holding more than scratch_memory_kept
+	float max_alpha_error;				//largest accumulated alpha added to any pixel by ending its merge at the opacity cutoff
+
+	DeepCounters() : input_samples(0), output_values(0), merge_steps(0), early_ends(0), dropped_hidden(0), dropped_transparent(0), allocations(0), samples_saved(0), releases(0), max_alpha_error(0) {}
+
+	void add(const DeepCounters& other)
+	{
+		input_samples += other.input_samples;
+		output_values += other.output_values;
+		merge_steps += other.merge_steps;
+		early_ends += other.early_ends;
+		dropped_hidden += other.dropped_hidden;
+		dropped_transparent += other.dropped_transparent;
+		allocations += other.allocations;
+		samples_saved += other.samples_saved;
+		releases += other.releases;
+		max_alpha_error = std::max(max_alpha_error, other.max_alpha_error);
+	}
+
+	//returns the counts so far and starts a new maximum, so since() can tell the work done in between
+	DeepCounters mark()
+	{
+		DeepCounters before = *this;
+		max_alpha_error = 0;
+		return before;
+	}
+
+	//the work done since mark() returned "before"; the maximum covers everything again afterwards
+	DeepCounters since(const DeepCounters& before)
+	{
+		DeepCounters work;
+		work.input_samples = input_samples - before.input_samples;
+		work.output_values = output_values - before.output_values;
+		work.merge_steps = merge_steps - before.merge_steps;
+		work.early_ends = early_ends - before.early_ends;
+		work.dropped_hidden = dropped_hidden - before.dropped_hidden;
+		work.dropped_transparent = dropped_transparent - before.dropped_transparent;
+		work.allocations = allocations - before.allocations;
+		work.samples_saved = samples_saved - before.samples_saved;
+		work.releases = releases - before.releases;
+		work.max_alpha_error = max_alpha_error;
+		max_alpha_error = std::max(max_alpha_error, before.max_alpha_error);
+		return work;
+	}
+};
+
+
+//the samples of all pixels of a DeepPlane, gathered once in depth order (closest first) into contiguous arrays: front, back and alpha for the merge itself and one array per output channel
+//this way each input pixel is only read through DeepPixel once per box, no matter how many footprints it is part of
+struct DeepSampleArena
+{
+	Box box;
+	size_t sample_total;					//number of samples, i.e. the length of each array
+	std::vector<size_t> first;				//index of the first sample of each pixel, plus one entry marking the end of the last one
+	std::vector<float> front;
+	std::vector<float> back;
+	std::vector<float> alpha;
+	std::vector<float> data;				//one array of "sample_total" values for each output channel
+	std::vector<unsigned char> scaled;		//whether an output channel gets scaled by the new alpha when merging (not for depth and missing channels)
+	std::vector<unsigned int> order;		//stored index of each sample of the pixel being gathered, from closest to furthest
+
+	size_t pixel(int y, int x) const {return (y - box.y()) * box.w() + x - box.x();}
+};
+
+
+void gatherDeepSamples(const DeepPlane& inPlane, const ChannelSet& channels, DeepSampleArena& arena, DeepCounters& counters)
+{
+	const Box& box = inPlane.box();
+	size_t pixel_total = box.w() * box.h();
+	size_t channel_count = channels.size();
+
+	//count the samples of all pixels first, so all arrays can be allocated at once
+	arena.box = box;
+	resizeScratch(arena.first, pixel_total + 1, counters.allocations);
+	arena.sample_total = 0;
+
+	size_t p = 0;
+	for (Box::iterator it = box.begin(); it != box.end(); it++)
+	{
+		arena.first[p++] = arena.sample_total;
+		arena.sample_total += inPlane.getPixel(it).getSampleCount();
+	}
+
+	arena.first[pixel_total] = arena.sample_total;
+	counters.input_samples += arena.sample_total;
+	resizeScratch(arena.front, arena.sample_total, counters.allocations);
+	resizeScratch(arena.back, arena.sample_total, counters.allocations);
+	resizeScratch(arena.alpha, arena.sample_total, counters.allocations);
+	resizeScratch(arena.data, arena.sample_total * channel_count, counters.allocations);
+
+	//resolve the channel layout of the plane once: the position of each channel within a stored sample, -1 for missing ones
+	ChannelMap channel_map(inPlane.channels());
+	size_t in_size = channel_map.size();
+	int front = channel_map.contains(Chan_DeepFront) ? channel_map.chanNo(Chan_DeepFront) : -1;
+	int back = channel_map.contains(Chan_DeepBack) ? channel_map.chanNo(Chan_DeepBack) : -1;
+	int alpha = channel_map.contains(Chan_Alpha) ? channel_map.chanNo(Chan_Alpha) : -1;
+	Channel anchor = inPlane.channels().first();		//any stored channel, to find the position of ordered samples in the data
+	std::vector<int> source;
+	arena.scaled.clear();
+
+	foreach (z, channels)
+	{
+		source.push_back(channel_map.contains(z) ? channel_map.chanNo(z) : -1);
+		arena.scaled.push_back(channel_map.contains(z) && (z != Chan_DeepFront) && (z != Chan_DeepBack));
+	}
+
+	//copy all samples, from closest to furthest, straight from the stored data
+	size_t n = 0;
+	for (Box::iterator it = box.begin(); it != box.end(); it++)
+	{
+		DeepPixel pixel = inPlane.getPixel(it);
+		size_t count = pixel.getSampleCount();
+		if ((count == 0) || !anchor)
+		{
+			std::fill(arena.front.begin() + n, arena.front.begin() + n + count, 0.0f);				//no stored channels at all, so every value is 0
+			std::fill(arena.back.begin() + n, arena.back.begin() + n + count, 0.0f);
+			std::fill(arena.alpha.begin() + n, arena.alpha.begin() + n + count, 0.0f);
+
+			for (size_t k = 0; k < channel_count; k++)
+				std::fill(arena.data.begin() + k * arena.sample_total + n, arena.data.begin() + k * arena.sample_total + n + count, 0.0f);
+
+			n += count;
+			continue;
+		}
+
+		//samples stored with strictly increasing fronts can only have one depth order, the stored one, so they are read as they are;
+		//otherwise the order DeepPixel resolved gets translated into stored indices once
+		const float* in = pixel.data();
+		bool sorted = (front >= 0);
+
+		for (size_t i = 1; sorted && (i < count); i++)
+			sorted = in[i * in_size + front] > in[(i - 1) * in_size + front];
+
+		if (!sorted)
+		{
+			size_t anchor_offset = channel_map.chanNo(anchor);
+
+			if (arena.order.size() < count)
+				resizeScratch(arena.order, count, counters.allocations);
+
+			for (size_t i = 0; i < count; i++)
+				arena.order[i] = (&pixel.getOrderedSample(count - 1 - i, anchor) - in - anchor_offset) / in_size;
+		}
+
+		for (size_t i = 0; i < count; i++, n++)
+		{
+			const float* sample = in + (sorted ? i : arena.order[i]) * in_size;
+			arena.front[n] = (front < 0) ? 0 : sample[front];
+			arena.back[n] = (back < 0) ? 0 : sample[back];
+			arena.alpha[n] = (alpha < 0) ? 0 : sample[alpha];
+
+			for (size_t k = 0; k < channel_count; k++)
+				arena.data[k * arena.sample_total + n] = (source[k] < 0) ? 0 : sample[source[k]];
+		}
+	}
+}
+
+
+//sample access for mergeDeepSamples on an arena; "pixels" holds the arena index of each input pixel of the current footprint
+struct DeepArenaSource
+{
+	const DeepSampleArena& arena;
+	const size_t* pixels;
+
+	DeepArenaSource(const DeepSampleArena& samples) : arena(samples), pixels(0) {}
+
+	size_t getSampleCount(int i) const {return arena.first[pixels[i] + 1] - arena.first[pixels[i]];}
+	float getDepth(int i, size_t sampleNo) const {return arena.front[arena.first[pixels[i]] + sampleNo];}
+	float getAlpha(int i, size_t sampleNo) const {return arena.alpha[arena.first[pixels[i]] + sampleNo];}
+
+	void getChannels(int i, size_t sampleNo, float factor, float* out) const
+	{
+		size_t channel_count = arena.scaled.size();
+		const float* in = &arena.data[arena.first[pixels[i]] + sampleNo];
+
+		for (size_t k = 0; k < channel_count; k++)
+			out[k] = in[k * arena.sample_total] * (arena.scaled[k] ? factor : 1.0f);
+	}
+};
+
+
+//two neighbouring samples that consolidateDeepSamples may merge, ordered so the std heap functions keep the cheapest merge on top; the versions tell whether either sample has changed since
+struct DeepSamplePair
+{
+	float cost;
+	int left;
+	int right;
+	unsigned left_version;
+	unsigned right_version;
+
+	bool operator<(const DeepSamplePair& other) const
+	{
+		if (cost != other.cost)
+			return cost > other.cost;
+		return left > other.left;
+	}
+};
+
+
+//scratch memory of one render thread, which is reset for every box but keeps its memory, so once it has grown large enough the render loops don't touch the heap anymore
+//upstream ops running on the same thread use it as well, so its contents are only valid until the next call into another op (e.g. deepEngine or Iop::get)
+struct DeepScratch
+{
+	//merge state, one entry per input pixel
+	std::vector<size_t> sampleCount;
+	std::vector<size_t> sampleNo;
+	std::vector<float> distance;
+	std::vector<float> alpha;
+	std::vector<float> alpha_accum;
+	std::vector<int> heap;
+
+	//input samples, footprints and output pixels of the ops
+	DeepSampleArena arena;
+	std::vector<size_t> footprint;
+	std::vector<float> weight;
+	std::vector<DeepOutPixel> pixels;
+	std::vector<DeepOutPixel> rows;		//output pixels of renderDeepRows, before they are added to the output plane
+	std::vector<size_t> row_capacity;	//capacity of each output pixel of a band before it gets rendered, to count the ones that had to grow
+	DeepOutPixel outPixel;
+
+	//footprint shared by all pixels of a box: offsets of its taps from the pixel in the arena, and their weights
+	std::vector<size_t> tap_offset;
+	std::vector<float> tap_weight;
+
+	DeepOutPixelSource merged;			//merged pixels read by the second pass of the separable and sliding window blurs
+
+	//consolidation state, one entry per output sample
+	std::vector<float> sample_visibility;
+	std::vector<int> sample_prev;
+	std::vector<int> sample_next;
+	std::vector<unsigned> sample_version;
+	std::vector<DeepSamplePair> sample_pairs;
+
+	//tidy state, one entry per input sample or depth
+	DeepOutPixel tidy_samples;
+	std::vector<int> tidy_order;
+	std::vector<int> tidy_active;
+	std::vector<float> tidy_depths;
+	std::vector<float> tidy_optical_depth;
+	std::vector<float> tidy_color_scale;
+	std::vector<float> tidy_sum;
+	std::vector<float> tidy_opaque_sum;
+	std::vector<float> tidy_sample;
+
+	//depth slices of the fast blur: the slice of each arena sample, and flat images of the slices of one band before and after each blur pass
+	std::vector<int> slice_index;
+	std::vector<size_t> slice_cursor;
+	std::vector<unsigned char> slice_done;
+	std::vector<float> slice_alpha_accum;
+	std::vector<float> slice_image;
+	std::vector<float> slice_rows;
+	std::vector<float> slice_blurred;
+
+	DeepCounters counters;				//work done on this thread, including how often the buffers above had to grow
+
+	void reserveMerge(size_t amount)
+	{
+		amount = std::max(amount, (size_t)1);
+
+		if (heap.size() >= amount)
+			return;
+
+		sampleCount.resize(amount);
+		sampleNo.resize(amount);
+		distance.resize(amount);
+		alpha.resize(amount);
+		alpha_accum.resize(amount);
+		heap.resize(amount);
+		counters.allocations++;
+	}
+};
+
+
+DeepScratch& threadScratch()
+{
+	static thread_local DeepScratch scratch;
+	return scratch;
+}
+
+
+const size_t scratch_memory_kept = (size_t)64 << 20;		//scratch memory a thread may keep for its next box; a thread holding more gives it all back once a box is done
+
+
+template <class T>
+size_t scratchMemory(const std::vector<T>& buffer)
+{
+	return buffer.capacity() * sizeof(T);
+}
+
+
+size_t scratchMemory(const std::vector<DeepOutPixel>& pixels)
+{
+	size_t memory = pixels.capacity() * sizeof(DeepOutPixel);
+	for (size_t i = 0; i < pixels.size(); i++)
+		memory += pixels[i].capacity() * sizeof(float);
+
+	return memory;
+}
+
+
+template <class T>
+void releaseScratch(std::vector<T>& buffer)
+{
+	std::vector<T>().swap(buffer);
+}
+
+
+//gives back the buffers that grow with the size of a box if together they hold more than scratch_memory_kept, so one large box doesn't tie up memory on every thread that ever rendered one;
+//smaller boxes keep reusing them. Must only be called once a box is done, when none of the buffers are in use anymore
+void trimScratch(DeepScratch& scratch)
+{
+	DeepSampleArena& arena = scratch.arena;
+	size_t memory = scratchMemory(arena.first) + scratchMemory(arena.front) + scratchMemory(arena.back) + scratchMemory(arena.alpha) + scratchMemory(arena.data) + scratchMemory(arena.order);
+	memory += scratchMemory(scratch.pixels) + scratchMemory(scratch.rows) + scratchMemory(scratch.row_capacity);
+	memory += scratchMemory(scratch.slice_index) + scratchMemory(scratch.slice_image) + scratchMemory(scratch.slice_rows) + scratchMemory(scratch.slice_blurred);
+
+	if (memory <= scratch_memory_kept)
+		return;
+
+	releaseScratch(arena.first);
+	releaseScratch(arena.front);
+	releaseScratch(arena.back);
+	releaseScratch(arena.alpha);
+	releaseScratch(arena.data);
+	releaseScratch(arena.order);
+	releaseScratch(scratch.pixels);
+	releaseScratch(scratch.rows);
+	releaseScratch(scratch.row_capacity);
+	releaseScratch(scratch.slice_index);
+	releaseScratch(scratch.slice_image);
+	releaseScratch(scratch.slice_rows);
+	releaseScratch(scratch.slice_blurred);
+	scratch.counters.releases++;
+}
+
+
+const int band_rows_min = 4;		//bands smaller than this aren't worth a thread of their own
+const int bands_per_thread = 4;		//more bands than threads, so threads that finish early can take over the remaining rows
+
+
+//rows that are split into bands and processed by several threads, including the one that started the job; each thread takes the next unprocessed band until there are none left
+//the counters of the spawned threads' scratch memory are handed back to the thread that started the job
+template <class Work>
+struct DeepBandJob
+{
+	Work* work;
+	int begin;
+	int end;
+	int band_rows;
+	std::atomic<int> next_band;
+	DeepCounters counters;
+	Lock lock;
+
+	void takeBands()
+	{
+		for (;;)
+		{
+			int band_begin = begin + next_band++ * band_rows;
+			if (band_begin >= end)
+				break;
+
+			(*work)(band_begin, std::min(band_begin + band_rows, end));
+		}
+	}
+
+	//entry point of the spawned threads; the thread that started the job calls takeBands directly, as its scratch memory may still be in use by the box
+	static void run(unsigned, unsigned, void* data)
+	{
+		DeepBandJob* job = static_cast<DeepBandJob*>(data);
+		DeepScratch& scratch = threadScratch();
+		DeepCounters before = scratch.counters.mark();
+
+		job->takeBands();
+
+		trimScratch(scratch);
+		DeepCounters work = scratch.counters.since(before);
+		Guard guard(job->lock);
+		job->counters.add(work);
+	}
+};
+
+
+//number of threads for processing "rows" rows in bands, including the calling thread: at most max_threads (0 -> all cores), but not more than there are bands of band_rows_min rows
+int deepBandThreads(int rows, int max_threads)
+{
+	int threads = max_threads > 0 ? max_threads : (int)Thread::numThreads;
+	return std::max(std::min(threads, rows / band_rows_min), 1);
+}
+
+
+//calls work(band_begin, band_end) for bands of the rows [begin, end), spread over up to max_threads threads; work must only write to memory that belongs to its own rows
+template <class Work>
+void forEachDeepBand(int begin, int end, int max_threads, Work& work)
+{
+	int threads = deepBandThreads(end - begin, max_threads);
+
+	if (threads == 1)
+	{
+		if (begin < end)
+			work(begin, end);
+		return;
+	}
+
+	DeepBandJob<Work> job;
+	job.work = &work;
+	job.begin = begin;
+	job.end = end;
+	job.band_rows = std::max(band_rows_min, (end - begin + threads * bands_per_thread - 1) / (threads * bands_per_thread));
+	job.next_band = 0;
+
+	Thread::spawn(DeepBandJob<Work>::run, threads - 1, &job);
+	job.takeBands();
+	Thread::wait(&job);
+
+	threadScratch().counters.add(job.counters);
+}
+
+
+//passes the part of the output pixels that belongs to a band on to render
+template <class Render>
+struct DeepRowsWork
+{
+	Render* render;
+	DeepOutPixel* pixels;
+	int origin;
+	int width;
+
+	void operator()(int begin, int end)
+	{
+		DeepOutPixel* band = pixels + (size_t)(begin - origin) * width;
+		size_t count = (size_t)(end - begin) * width;
+		DeepScratch& scratch = threadScratch();
+		resizeScratch(scratch.row_capacity, count, scratch.counters.allocations);
+
+		for (size_t i = 0; i < count; i++)
+			scratch.row_capacity[i] = band[i].capacity();
+
+		(*render)(begin, end, band);
+
+		for (size_t i = 0; i < count; i++)
+			scratch.counters.allocations += band[i].capacity() > scratch.row_capacity[i];
+	}
+};
+
+
+//the finished output pixels of a box, stored compactly: the number of values of each pixel, and all of their values back to back
+struct DeepTile
+{
+	std::vector<unsigned int> sizes;
+	std::vector<float> values;
+
+	void add(const DeepOutPixel& pixel)
+	{
+		sizes.push_back(pixel.size());
+		values.insert(values.end(), pixel.begin(), pixel.end());
+	}
+
+	size_t bytes() const {return sizes.capacity() * sizeof(unsigned int) + values.capacity() * sizeof(float);}
+};
+
+
+//finished boxes of an op, so a box that gets requested again while the inputs and knobs haven't changed doesn't need to be rendered again
+//boxes are keyed on the op hash, which covers all knobs and inputs, together with the box and the channels; once all boxes together take up more than the budget, the least recently used ones get evicted
+//the tiles are shared, so a found box can be copied out after releasing the lock while it gets evicted by another thread
+class DeepTileCache
+{
+	private:
+		struct Entry
+		{
+			U64 key;
+			U64 hash;
+			Box box;
+			ChannelSet channels;
+			std::shared_ptr<const DeepTile> tile;
+
+			bool matches(const Hash& h, const Box& b, const ChannelSet& c) const
+			{
+				return (hash == h.value()) && (box.x() == b.x()) && (box.y() == b.y()) && (box.r() == b.r()) && (box.t() == b.t()) && (channels == c);
+			}
+		};
+
+		std::list<Entry> entries;											//most recently used first
+		std::unordered_map<U64, std::list<Entry>::iterator> index;
+		size_t memory;
+		size_t budget;
+		Lock lock;
+
+		static U64 key(const Hash& hash, const Box& box, const ChannelSet& channels)
+		{
+			Hash key = hash;
+			key.append(box.x());
+			key.append(box.y());
+			key.append(box.r());
+			key.append(box.t());
+
+			foreach (z, channels)
+				key.append((int)z);
+
+			return key.value();
+		}
+
+		void evict(size_t limit)
+		{
+			while (!entries.empty() && (memory > limit))
+			{
+				memory -= entries.back().tile->bytes() + sizeof(Entry);
+				index.erase(entries.back().key);
+				entries.pop_back();
+			}
+		}
+
+	public:
+		std::atomic<size_t> hits;
+		std::atomic<size_t> misses;
+
+		DeepTileCache() : memory(0), budget(0), hits(0), misses(0) {}
+
+		bool enabled() const {return budget > 0;}
+
+		size_t size() const {return memory;}
+
+		//sets the memory budget in bytes and evicts boxes until it is met; 0 turns the cache off and frees all boxes
+		void setBudget(size_t bytes)
+		{
+			Guard guard(lock);
+			budget = bytes;
+			evict(budget);
+		}
+
+		//fills the output plane with a stored box and returns true, or counts a miss and returns false
+		bool find(const Hash& hash, const Box& box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+		{
+			if (!enabled())
+				return false;
+
+			std::shared_ptr<const DeepTile> found;
+
+			{
+				Guard guard(lock);
+				std::unordered_map<U64, std::list<Entry>::iterator>::iterator it = index.find(key(hash, box, channels));
+
+				if ((it == index.end()) || !it->second->matches(hash, box, channels))
+				{
+					misses++;
+					return false;
+				}
+
+				entries.splice(entries.begin(), entries, it->second);		//mark as most recently used
+				found = entries.front().tile;
+			}
+
+			hits++;
+
+			const DeepTile& tile = *found;
+			DeepOutPixel& outPixel = threadScratch().outPixel;
+			const float* values = tile.values.empty() ? 0 : &tile.values[0];
+			outPlane = DeepOutputPlane(channels, box);
+
+			for (size_t i = 0; i < tile.sizes.size(); i++)
+			{
+				outPixel.assign(values, values + tile.sizes[i]);
+				outPlane.addPixel(outPixel);
+				values += tile.sizes[i];
+			}
+
+			return true;
+		}
+
+		//stores a rendered box, taking over the memory of "tile"
+		void insert(const Hash& hash, const Box& box, const ChannelSet& channels, DeepTile& tile)
+		{
+			if (!enabled())
+				return;
+
+			tile.sizes.shrink_to_fit();
+			tile.values.shrink_to_fit();
+			size_t bytes = tile.bytes() + sizeof(Entry);
+
+			std::shared_ptr<DeepTile> stored = std::make_shared<DeepTile>();
+			stored->sizes.swap(tile.sizes);
+			stored->values.swap(tile.values);
+
+			Guard guard(lock);
+			if (bytes > budget)
+				return;
+
+			U64 k = key(hash, box, channels);
+			std::unordered_map<U64, std::list<Entry>::iterator>::iterator it = index.find(k);
+
+			if (it != index.end())															//rendered by another thread in the meantime, or a different box with the same key
+			{
+				memory -= it->second->tile->bytes() + sizeof(Entry);
+				entries.erase(it->second);
+				index.erase(it);
+			}
+
+			evict(budget - bytes);
+
+			entries.push_front(Entry());
+			Entry& entry = entries.front();
+			entry.key = k;
+			entry.hash = hash.value();
+			entry.box = box;
+			entry.channels = channels;
+			entry.tile = stored;
+			index[k] = entries.begin();
+			memory += bytes;
+		}
+};
+
+
+//calls render(y_begin, y_end, pixels) to fill the output pixels of the rows [y_begin, y_end) of the box, in the order of the box iterator, and adds them to the output plane (and to "record", if given)
+//large boxes are rendered in bands on up to max_threads threads and added once all bands are done, so the output plane is the same for any number of threads
+//this is the last step of an op's box, so the scratch memory of the box gets trimmed afterwards
+template <class Render>
+void renderDeepRows(const Box& box, int max_threads, Render& render, DeepOutputPlane& outPlane, DeepTile* record = 0)
+{
+	DeepScratch& scratch = threadScratch();
+	std::vector<DeepOutPixel>& pixels = scratch.rows;
+	size_t width = std::max(box.w(), 0);
+	bool serial = deepBandThreads(box.h(), max_threads) == 1;
+	size_t size = serial ? width : width * box.h();		//the serial path only keeps one row
+
+	if (width == 0)
+		return;
+
+	if (pixels.size() < size)		//never shrink, so the pixels keep their memory for the next box, unless trimScratch releases it
+		resizeScratch(pixels, size, scratch.counters.allocations);
+
+	DeepRowsWork<Render> work;
+	work.render = &render;
+	work.pixels = &pixels[0];
+	work.width = width;
+
+	if (serial)
+	{
+		if (record)
+			record->sizes.reserve(record->sizes.size() + width * box.h());
+
+		for (int y = box.y(); y < box.t(); y++)
+		{
+			work.origin = y;
+			work(y, y + 1);
+
+			for (size_t x = 0; x < width; x++)
+			{
+				outPlane.addPixel(pixels[x]);
+				scratch.counters.output_values += pixels[x].size();
+				if (record)
+					record->add(pixels[x]);
+			}
+		}
+
+		trimScratch(scratch);
+		return;
+	}
+
+	work.origin = box.y();
+	forEachDeepBand(box.y(), box.t(), max_threads, work);
+
+	if (record)			//all pixels are known at this point, so the record only needs to grow once
+	{
+		size_t values = 0;
+		for (size_t i = 0; i < size; i++)
+			values += pixels[i].size();
+
+		record->sizes.reserve(record->sizes.size() + size);
+		record->values.reserve(record->values.size() + values);
+	}
+
+	for (size_t i = 0; i < size; i++)
+	{
+		outPlane.addPixel(pixels[i]);
+		scratch.counters.output_values += pixels[i].size();
+		if (record)
+			record->add(pixels[i]);
+	}
+
+	trimScratch(scratch);
+}
+
+
+//what an op did, summed up over all boxes it rendered since the stats were last reset; boxes get added once they are done, from any render thread
+struct DeepStats
+{
+	DeepCounters counters;
+	size_t boxes;
+	size_t output_samples;
+	double time;					//seconds spent rendering all boxes, not counting the inputs
+	double max_time;				//seconds spent on the slowest box
+	Lock lock;
+
+	DeepStats() : boxes(0), output_samples(0), time(0), max_time(0) {}
+
+	void add(const DeepCounters& work, size_t channel_count, double seconds)
+	{
+		Guard guard(lock);
+		counters.add(work);
+		boxes++;
+		output_samples += work.output_values / std::max(channel_count, (size_t)1);
+		time += seconds;
+		max_time = std::max(max_time, seconds);
+	}
+
+	void reset()
+	{
+		Guard guard(lock);
+		counters = DeepCounters();
+		boxes = output_samples = 0;
+		time = max_time = 0;
+	}
+
+	//the stats as "name": value pairs, one per line in the text for the stats tab, or all in one line of JSON
+	std::string format(const DeepTileCache* cache, bool json)
+	{
+		Guard guard(lock);
+		const char* pair = json ? "\"%s\": %.9g" : "%s: %.9g";
+		const char* separator = json ? ", " : "\n";
+
+		struct Value {const char* name; double value;};
+		Value values[] =
+		{
+			{"boxes", (double)boxes},
+			{"time", time},
+			{"time_per_box", boxes ? time / boxes : 0},
+			{"max_time_per_box", max_time},
+			{"input_samples", (double)counters.input_samples},
+			{"output_samples", (double)output_samples},
+			{"merge_steps", (double)counters.merge_steps},
+			{"early_ends", (double)counters.early_ends},
+			{"dropped_hidden", (double)counters.dropped_hidden},
+			{"dropped_transparent", (double)counters.dropped_transparent},
+			{"samples_saved", (double)counters.samples_saved},
+			{"max_alpha_error", counters.max_alpha_error},
+			{"allocations", (double)counters.allocations},
+			{"releases", (double)counters.releases},
+			{"cache_hits", cache ? (double)cache->hits : 0},
+			{"cache_misses", cache ? (double)cache->misses : 0},
+			{"cache_memory", cache ? (double)cache->size() : 0}
+		};
+
+		std::string text;
+		char buffer[128];
+
+		for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+		{
+			snprintf(buffer, sizeof(buffer), pair, values[i].name, values[i].value);
+			text += (i ? separator : "");
+			text += buffer;
+		}
+
+		return text;
+	}
+};
+
+
+//counts the work of one box from construction to destruction into "stats"; meant to be created once the inputs are fetched, so the work of upstream ops on the same thread isn't counted
+class DeepStatsScope
+{
+	private:
+		DeepStats& stats;
+		size_t channel_count;
+		DeepCounters before;
+		std::chrono::steady_clock::time_point start;
+
+	public:
+		DeepStatsScope(DeepStats& box_stats, const ChannelSet& channels) : stats(box_stats), channel_count(channels.size())
+		{
+			before = threadScratch().counters.mark();
+			start = std::chrono::steady_clock::now();
+		}
+
+		~DeepStatsScope()
+		{
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			stats.add(threadScratch().counters.since(before), channel_count, seconds);
+		}
+
+		//counts the samples of an input plane that isn't read through gatherDeepSamples
+		void read(const DeepPlane& plane)
+		{
+			size_t samples = 0;
+			for (Box::iterator it = plane.box().begin(); it != plane.box().end(); it++)
+				samples += plane.getPixel(it).getSampleCount();
+
+			threadScratch().counters.input_samples += samples;
+		}
+};
+
+
+//the knobs of the stats tab that all ops share: the stats as read-only text, and buttons to update, reset and write them
+void deepStatsKnobs(Knob_Callback f, const char** text, const char** file)
+{
+	Tab_knob(f, "stats");
+
+	Multiline_String_knob(f, text, "stats_text", "stats", 16);
+	Tooltip(f, "What this node did in all boxes it rendered since the stats were last reset: how many input samples it read and output samples it wrote, how many samples the merges went through (merge_steps), how many merges ended early at an opaque sample or the opacity cutoff, how many samples were dropped, how often the memory reused from box to box, i.e. the scratch buffers and output pixels, had to grow (allocations) or was given back (releases), and how long the boxes took, not counting the time spent on the inputs. Press \"update\" to show the latest numbers.");
+	SetFlags(f, Knob::READ_ONLY | Knob::DO_NOT_WRITE | Knob::NO_RERENDER | Knob::NO_ANIMATION);
+
+	Button(f, "update_stats", "update");
+	Tooltip(f, "Show the latest stats.");
+	SetFlags(f, Knob::STARTLINE);
+
+	Button(f, "reset_stats", "reset");
+	Tooltip(f, "Set all stats back to 0.");
+
+	File_knob(f, file, "stats_file", "json file");
+	Tooltip(f, "If set, the stats get appended to this file as one line of JSON whenever \"write\" is pressed and when the node gets closed, e.g. at the end of a render on the farm.");
+	SetFlags(f, Knob::NO_RERENDER);
+
+	Button(f, "write_stats", "write");
+	Tooltip(f, "Append the stats to the json file now.");
+}
+
+
+//appends the stats of an op as one line of JSON to "file"; returns false if the file couldn't be written
+bool writeDeepStats(Op* op, DeepStats& stats, const DeepTileCache* cache, const char* file)
+{
+	if (!file || !*file)
+		return true;
+
+	FILE* json = fopen(file, "a");
+	if (!json)
+		return false;
+
+	std::string node = op->node_name();
+	fprintf(json, "{\"node\": \"%s\", \"class\": \"%s\", %s}\n", node.c_str(), op->Class(), stats.format(cache, true).c_str());
+	fclose(json);
+	return true;
+}
+
+
+//handles the buttons of the stats tab and shows the latest stats when the panel opens; returns 1 if "k" was one of the buttons
+int deepStatsKnobChanged(Op* op, Knob* k, DeepStats& stats, DeepTileCache* cache, const char* file)
+{
+	if (k->is("reset_stats"))
+	{
+		stats.reset();
+
+		if (cache)
+			cache->hits = cache->misses = 0;
+	}
+
+	else if (k->is("write_stats"))
+	{
+		if (!writeDeepStats(op, stats, cache, file))
+			op->error("Can't write the stats to %s", file);
+	}
+
+	else if (!k->is("update_stats") && (k != &Knob::showPanel))
+		return 0;
+
+	op->knob("stats_text")->set_text(stats.format(cache, false).c_str());
+	return k != &Knob::showPanel;
+}
+
+
+//makes the last sample of a pixel opaque, keeping its unpremultiplied color, so it takes over the remaining transparency of the pixel; returns the accumulated alpha added that way
+inline float foldDeepResidual(float* sample, const ChannelSet& channels, float alpha, float alpha_accum)
+{
+	if (alpha <= 0)
+		return 0;
+
+	float scale = 1 / alpha;
+	size_t k = 0;
+
+	foreach (z, channels)
+	{
+		if ((z != Chan_DeepFront) && (z != Chan_DeepBack))
+			sample[k] *= scale;
+		k++;
+	}
+
+	return 1 - alpha_accum;
+}
+
+
+//merge state of one mergeDeepSamples call, one entry per input pixel: on the stack if the number of input pixels is known at compile time, so the loops over them can be unrolled
+template <int FanIn>
+struct DeepMergeState
+{
+	size_t sampleCount[FanIn];
+	size_t sampleNo[FanIn];
+	float distance[FanIn];
+	float alpha[FanIn];
+	float alpha_accum[FanIn];
+	int heap[FanIn];
+
+	DeepMergeState(DeepScratch&, int) {}
+};
+
+
+//any other number of input pixels uses the scratch memory of the thread
+template <>
+struct DeepMergeState<0>
+{
+	size_t* sampleCount;
+	size_t* sampleNo;
+	float* distance;
+	float* alpha;
+	float* alpha_accum;
+	int* heap;
+
+	DeepMergeState(DeepScratch& scratch, int amount)
+	{
+		scratch.reserveMerge(amount);
+		sampleCount = &scratch.sampleCount[0];
+		sampleNo = &scratch.sampleNo[0];
+		distance = &scratch.distance[0];
+		alpha = &scratch.alpha[0];
+		alpha_accum = &scratch.alpha_accum[0];
+		heap = &scratch.heap[0];
+	}
+};
+
+
+//mergeDeepSamples for FanIn input pixels, or for any number of them with FanIn 0
+//with two input pixels the heap is replaced by a plain comparison of the two next samples, which takes them in the same order
+template <int FanIn, class Source>
+void mergeDeepSamplesFanIn(Source& source, DeepOutPixel& outPixel, const ChannelSet& channels, int runtime_amount, const float weight[], bool drop_hidden, bool drop_transparent, float transparency_threshold, float opacity_cutoff)
+{
+	DeepScratch& scratch = threadScratch();
+	const int amount = FanIn ? FanIn : runtime_amount;
+	DeepMergeState<FanIn> state(scratch, amount);
+
+	size_t* sampleCount = state.sampleCount;
+	size_t* sampleNo = state.sampleNo;
+	float* distance = state.distance;
+	float* alpha = state.alpha;
+	float* alpha_accum = state.alpha_accum;
+	int* heap = state.heap;																							//indices of all pixels with samples left, as a min heap on "distance" (in pixel order for two pixels)
+	int heap_size = 0;
 	float alpha_accum_combined = 0;
 	float designated_alpha_accum = 0;
+	DeepMergeOrder order(distance);
+	size_t total = 0;
+	size_t steps = 0;
+	size_t dropped = 0;
 
 	for (int i = 0; i < amount; i++)
 	{
-		sampleCount[i] = inPixels[i].getSampleCount();
+		sampleCount[i] = source.getSampleCount(i);
 		sampleNo[i] = 0;
+		total += sampleCount[i];
 
 		if (sampleCount[i] > 0)
-			distance[i] = inPixels[i].getOrderedSample(sampleCount[i] - 1, Chan_DeepFront);							//get depth of closest sample from each pixel
+		{
+			distance[i] = source.getDepth(i, 0);							//get depth of closest sample from each pixel
+			heap[heap_size++] = i;
+		}
 		else
 			distance[i] = FLT_MAX;
 
@@ -51,124 +1157,738 @@ void combineDeepPixels(std::vector<DeepPixel>& inPixels, DeepOutPixel& outPixel,
 		alpha_accum[i] = 0;
 	}
 
+	if (total == 0)																									//all pixels are empty
+		return;
+
+	//without dropping, every input sample becomes exactly one output sample, so the output pixel is grown to its final size at once and the samples are written straight into place;
+	//otherwise it grows by one sample at a time, which only needs new memory until the scratch pixels have grown large enough
+	size_t channel_count = channels.size();
+	bool exact_size = !drop_hidden && !drop_transparent;
+	size_t next = outPixel.size();																					//where the next output sample goes
+
+	if (exact_size)
+		outPixel.resize(next + total * channel_count);
+
+	bool ended = false;
 
-	while (std::accumulate(sampleNo, sampleNo + amount, 0) < std::accumulate(sampleCount, sampleCount + amount, 0))
-	{	
-		float* smallest_element = std::min_element(distance, distance + amount);									//get a pointer to the smallest element in the "distance" list
-		int a = std::distance(distance, smallest_element);															//get the pointer's position in the list
+	if (total == (size_t)heap_size)
+	{
+		//every pixel has at most one sample, like on hard surfaces: the samples only need to be put into depth order once, in the order the heap would take them (ties go to the lower pixel index);
+		//an insertion sort is quick for the few samples of a footprint and stays within bounds even if depths don't compare (NaN)
+		for (int k = 1; k < heap_size; k++)
+		{
+			int i = heap[k];
+			int j = k;
 
-		int inverted_sampleCount = sampleCount[a] - 1 - sampleNo[a];												//accessing sample from highest to lowest index, i.e. from closest to furthest Z distance
-		alpha[a] = inPixels[a].getOrderedSample(inverted_sampleCount, Chan_Alpha);									//unaltered alpha of this sample
+			for (; (j > 0) && order(heap[j - 1], i); j--)
+				heap[j] = heap[j - 1];
+
+			heap[j] = i;
+		}
 
-		if (!((alpha[a] <= transparency_threshold) && (drop_transparent == true)))									//skip transparent sample if eligable
+		//the same merge as below, where the accumulated alpha of each pixel is still 0 before its only sample
+		for (int k = 0; (k < heap_size) && !ended; k++)
 		{
-			if (alpha[a] == 0)																						//if the sample is completely transparent, it can be simply piped through 
+			int a = heap[k];
+			steps++;
+			alpha[a] = source.getAlpha(a, 0);
+
+			if (((alpha[a] <= transparency_threshold) && (drop_transparent == true)))
 			{
-				outPixel.reserveMore(channels.size());
-				foreach (z, channels)
-					if (inPixels[a].channels().contains(z))
-						outPixel.push_back(inPixels[a].getOrderedSample(inverted_sampleCount, z));
-					else
-						outPixel.push_back(0);
+				dropped++;
+				continue;
 			}
 
-			else
+			float new_alpha = alpha[a];
+
+			if (alpha[a] != 0)
 			{
-				designated_alpha_accum -= alpha_accum[a] * weight[a];												//subtract a's prior contribution to the designated accumulated alpha, so it can be properly re-calculated for the current sample's depth
-				alpha_accum[a] += alpha[a] * (1 - alpha_accum[a]);													//unaltered accumulated alpha up to the current depth (= from camera to the current sample's depth) in pixel a
-				designated_alpha_accum += alpha_accum[a] * weight[a];												//new accumulated alpha is supposed to be the avarage of the accumulated alphas of all pixels up to the current depht										
-			
-				float new_alpha;
+				alpha_accum[a] = alpha[a];
+				designated_alpha_accum += alpha[a] * weight[a];
+
 				if (designated_alpha_accum < 1)
-					new_alpha = (designated_alpha_accum - alpha_accum_combined) / (1 - alpha_accum_combined);		//new alpha of the current sample needs to raise accumulated alpha of the combined pixel to it's designated value
-				else
-					new_alpha = alpha[a];
+					new_alpha = (designated_alpha_accum - alpha_accum_combined) / (1 - alpha_accum_combined);
+
+				alpha_accum_combined += new_alpha * (1 - alpha_accum_combined);
 
-				alpha_accum_combined += new_alpha * (1 - alpha_accum_combined);										//add the current sample to the accumulated alpha of the combined pixel
+				if ((new_alpha <= transparency_threshold) && (drop_transparent == true))
+				{
+					dropped++;
+					continue;
+				}
+			}
+
+			size_t offset = next;
+			next += channel_count;
+			if (!exact_size)
+				outPixel.resize(next);
+			source.getChannels(a, 0, (alpha[a] != 0) ? new_alpha / alpha[a] : 1.0f, &outPixel[offset]);
+
+			if ((alpha[a] != 0) && (new_alpha == 1) && (drop_hidden == true))
+				ended = true;
+
+			else if ((alpha[a] != 0) && (alpha_accum_combined >= opacity_cutoff) && (opacity_cutoff < 1) && (drop_hidden == true))
+			{
+				float alpha_error = foldDeepResidual(&outPixel[offset], channels, new_alpha, alpha_accum_combined);
+				scratch.counters.max_alpha_error = std::max(scratch.counters.max_alpha_error, alpha_error);
+				ended = true;
+			}
+		}
+	}
+
+	else
+	{
+		if (FanIn != 2)
+			std::make_heap(heap, heap + heap_size, order);
 
+		while (heap_size > 0)
+		{	
+			int a = heap[0];																							//the pixel holding the closest of all remaining samples
+			if ((FanIn == 2) && (heap_size == 2) && order(heap[0], heap[1]))
+				a = heap[1];
+			steps++;
 
-				if (!((new_alpha <= transparency_threshold) && (drop_transparent == true)))
+			size_t s = sampleNo[a];																						//samples are accessed from closest to furthest Z distance
+			alpha[a] = source.getAlpha(a, s);									//unaltered alpha of this sample
+
+			if (!((alpha[a] <= transparency_threshold) && (drop_transparent == true)))									//skip transparent sample if eligable
+			{
+				if (alpha[a] == 0)																						//if the sample is completely transparent, it can be simply piped through 
 				{
-					outPixel.reserveMore(channels.size());
-					float new_alpha_factor = new_alpha / alpha[a];
+					size_t offset = next;
+					next += channel_count;
+					if (!exact_size)
+						outPixel.resize(next);
+					source.getChannels(a, s, 1.0f, &outPixel[offset]);
+				}
 
-					foreach (z, channels)
-					{
-						if ((z == Chan_DeepFront) || (z == Chan_DeepBack))
-							outPixel.push_back(inPixels[a].getOrderedSample(inverted_sampleCount, z));
-						else
-							if (inPixels[a].channels().contains(z))
-								outPixel.push_back(inPixels[a].getOrderedSample(inverted_sampleCount, z) * new_alpha_factor);	
-							else
-								outPixel.push_back(0);			
-					}
+				else
+				{
+					designated_alpha_accum -= alpha_accum[a] * weight[a];												//subtract a's prior contribution to the designated accumulated alpha, so it can be properly re-calculated for the current sample's depth
+					alpha_accum[a] += alpha[a] * (1 - alpha_accum[a]);													//unaltered accumulated alpha up to the current depth (= from camera to the current sample's depth) in pixel a
+					designated_alpha_accum += alpha_accum[a] * weight[a];												//new accumulated alpha is supposed to be the avarage of the accumulated alphas of all pixels up to the current depht										
+			
+					float new_alpha;
+					if (designated_alpha_accum < 1)
+						new_alpha = (designated_alpha_accum - alpha_accum_combined) / (1 - alpha_accum_combined);		//new alpha of the current sample needs to raise accumulated alpha of the combined pixel to it's designated value
+					else
+						new_alpha = alpha[a];
+
+					alpha_accum_combined += new_alpha * (1 - alpha_accum_combined);										//add the current sample to the accumulated alpha of the combined pixel
 
-					if ((new_alpha == 1) && (drop_hidden == true))													//end function if sample is opaque and hidden samples should be dropped
+
+					if (!((new_alpha <= transparency_threshold) && (drop_transparent == true)))
 					{
-						delete[] sampleCount;
-						delete[] sampleNo;
-						delete[] distance;
-						delete[] alpha;
-						delete[] alpha_accum;
+						size_t offset = next;
+						next += channel_count;
+						if (!exact_size)
+							outPixel.resize(next);
+						source.getChannels(a, s, new_alpha / alpha[a], &outPixel[offset]);
+
+						if ((new_alpha == 1) && (drop_hidden == true))													//end merge if sample is opaque and hidden samples should be dropped
+							break;
 
-						return;
+						if ((alpha_accum_combined >= opacity_cutoff) && (opacity_cutoff < 1) && (drop_hidden == true))					//end merge if the remaining samples could barely change the pixel anymore
+						{
+							float alpha_error = foldDeepResidual(&outPixel[offset], channels, new_alpha, alpha_accum_combined);
+							scratch.counters.max_alpha_error = std::max(scratch.counters.max_alpha_error, alpha_error);
+							break;
+						}
 					}
+					else
+						dropped++;
+				}
+			}
+			else
+				dropped++;
+
+			sampleNo[a]++;
+
+			//change distance[a] to depth of next sample in a and re-insert a into the heap, so that one will be taken into account in the next cycle of the while loop
+			if (FanIn == 2)
+			{
+				if (sampleNo[a] < sampleCount[a])
+					distance[a] = source.getDepth(a, sampleNo[a]);
+
+				else
+				{
+					heap_size--;
+					if (heap[0] == a)
+						heap[0] = heap[1];
 				}
+
+				continue;
+			}
+
+			std::pop_heap(heap, heap + heap_size, order);
+			heap_size--;
+
+			if (sampleNo[a] < sampleCount[a])
+			{
+				distance[a] = source.getDepth(a, sampleNo[a]);
+				heap[heap_size++] = a;
+				std::push_heap(heap, heap + heap_size, order);
+			}
+		}
+
+		ended = heap_size > 0;
+	}
+
+	assert(!exact_size || (next == outPixel.size()));
+
+	//all samples a merge that ended early didn't get to are dropped as hidden
+	scratch.counters.merge_steps += steps;
+	scratch.counters.dropped_transparent += dropped;
+
+	if (ended)
+	{
+		scratch.counters.early_ends++;
+		scratch.counters.dropped_hidden += total - steps;
+	}
+}
+
+
+//merges the samples of "amount" pixels, provided by "source", into one pixel whose accumulated alpha at each depth is the weighted average of the accumulated alphas of the input pixels
+//with drop_hidden, the merge ends at the first opaque sample, or as soon as the accumulated alpha reaches opacity_cutoff (if below 1), in which case the last sample takes over the rest
+//the numbers of input pixels of a keymix and of the 3x3 and 5x5 blur kernels get their own compiled merge
+template <class Source>
+void mergeDeepSamples(Source& source, DeepOutPixel& outPixel, const ChannelSet& channels, int amount, const float weight[], bool drop_hidden, bool drop_transparent, float transparency_threshold, float opacity_cutoff = 1.0f)
+{
+	switch (amount)
+	{
+		case 2:
+			mergeDeepSamplesFanIn<2>(source, outPixel, channels, amount, weight, drop_hidden, drop_transparent, transparency_threshold, opacity_cutoff);
+			break;
+		case 9:
+			mergeDeepSamplesFanIn<9>(source, outPixel, channels, amount, weight, drop_hidden, drop_transparent, transparency_threshold, opacity_cutoff);
+			break;
+		case 25:
+			mergeDeepSamplesFanIn<25>(source, outPixel, channels, amount, weight, drop_hidden, drop_transparent, transparency_threshold, opacity_cutoff);
+			break;
+		default:
+			mergeDeepSamplesFanIn<0>(source, outPixel, channels, amount, weight, drop_hidden, drop_transparent, transparency_threshold, opacity_cutoff);
+	}
+}
+
+
+void combineDeepPixels(std::vector<DeepPixel>& inPixels, DeepOutPixel& outPixel, const ChannelSet& channels, int amount, const float weight[], bool drop_hidden = true, bool drop_transparent = true, float transparency_threshold = 0.0f, float opacity_cutoff = 1.0f)
+{
+	DeepPixelSource source(channels);
+
+	for (int i = 0; i < amount; i++)
+		source.push_back(inPixels[i]);
+
+	mergeDeepSamples(source, outPixel, channels, amount, weight, drop_hidden, drop_transparent, transparency_threshold, opacity_cutoff);
+}
+
+
+//describes how the samples of a pixel with "channel_map" are copied into a pixel laid out as "channels": as runs of consecutive channels, while missing channels are filled with 0
+struct ChannelRemap
+{
+	size_t in_size;					//number of floats per sample in the input pixel
+	size_t out_size;				//number of floats per sample in the output pixel
+	std::vector<size_t> source;		//first input channel of each run
+	std::vector<size_t> target;		//first output channel of each run
+	std::vector<size_t> length;		//number of channels in each run
+	bool identical;					//whole samples can be copied as they are
+};
+
+
+void calculateChannelRemap(const ChannelMap& channel_map, const ChannelSet& channels, ChannelRemap& remap)
+{
+	remap.in_size = channel_map.size();
+	remap.out_size = channels.size();
+	remap.source.clear();
+	remap.target.clear();
+	remap.length.clear();
+
+	size_t k = 0;
+
+	foreach (z, channels)
+	{
+		if (channel_map.contains(z))
+		{
+			size_t c = channel_map.chanNo(z);
+			size_t last = remap.length.size() - 1;
+
+			if (!remap.length.empty() && (remap.target[last] + remap.length[last] == k) && (remap.source[last] + remap.length[last] == c))
+				remap.length[last]++;														//continue the current run
+			else
+			{
+				remap.source.push_back(c);
+				remap.target.push_back(k);
+				remap.length.push_back(1);
 			}
 		}
 
-		sampleNo[a]++;
+		k++;
+	}
+
+	remap.identical = (remap.in_size == remap.out_size) && (remap.length.size() == 1) && (remap.source[0] == 0) && (remap.target[0] == 0) && (remap.length[0] == remap.out_size);
+}
+
+
+//appends all samples of inPixel to outPixel unchanged and in their stored order, rearranging the channels as described by "remap"
+void copyDeepPixel(const DeepPixel& inPixel, DeepOutPixel& outPixel, const ChannelRemap& remap)
+{
+	size_t count = inPixel.getSampleCount();
+	if (count == 0)
+		return;
+
+	const float* in = inPixel.data();
+
+	if (remap.identical)
+	{
+		outPixel.insert(outPixel.end(), in, in + count * remap.in_size);
+		return;
+	}
+
+	size_t offset = outPixel.size();
+	outPixel.resize(offset + count * remap.out_size);									//new values are 0, which takes care of missing channels
+	float* out = &outPixel[offset];
+	size_t runs = remap.length.size();
+
+	for (size_t i = 0; i < count; i++)
+	{
+		for (size_t r = 0; r < runs; r++)
+			std::copy(in + remap.source[r], in + remap.source[r] + remap.length[r], out + remap.target[r]);
+
+		in += remap.in_size;
+		out += remap.out_size;
+	}
+}
+
+
+//settings of consolidateDeepSamples, together with the positions of the depth and alpha channels in the output samples
+struct DeepConsolidation
+{
+	bool enabled;
+	float depth_tolerance;			//merge neighbouring samples whose fronts are no further apart than this
+	float alpha_error;				//merge neighbouring samples as long as less accumulated alpha than this gets moved to the front of the merged sample
+	int max_samples;				//then merge the least visible neighbours until no more than this many samples are left (0 -> no limit)
+	size_t front;
+	size_t back;
+	size_t alpha;
+	size_t size;
+
+	DeepConsolidation(const ChannelSet& channels, bool enable, float tolerance, float error, int max)
+	{
+		ChannelMap channel_map(channels);
+
+		enabled = enable && channel_map.contains(Chan_DeepFront) && channel_map.contains(Chan_DeepBack) && channel_map.contains(Chan_Alpha);
+		depth_tolerance = tolerance;
+		alpha_error = error;
+		max_samples = max;
+		front = enabled ? channel_map.chanNo(Chan_DeepFront) : 0;
+		back = enabled ? channel_map.chanNo(Chan_DeepBack) : 0;
+		alpha = enabled ? channel_map.chanNo(Chan_Alpha) : 0;
+		size = channels.size();
+	}
+};
+
+
+//composites "sample" under "group", which is in front of it; the merged sample reaches from the front of the group to the back of either
+inline void mergeDeepSample(float* group, const float* sample, const DeepConsolidation& settings)
+{
+	float transparency = 1 - group[settings.alpha];
 
-		//change distance[a] to depth of next sample in a, so that one will be taken into account in the next cycle of the while loop
-		if (sampleNo[a] < sampleCount[a])
-			distance[a] = inPixels[a].getOrderedSample(inverted_sampleCount - 1, Chan_DeepFront);
+	for (size_t k = 0; k < settings.size; k++)
+	{
+		if (k == settings.front)
+			group[k] = std::min(group[k], sample[k]);
+		else if (k == settings.back)
+			group[k] = std::max(group[k], sample[k]);
 		else
-			distance[a] = FLT_MAX;
+			group[k] += sample[k] * transparency;
+	}
+}
+
+
+//merges neighbouring samples of a pixel written by mergeDeepSamples (closest first) by compositing them over each other
+//the flattened pixel stays the same, only the alpha gets distributed over fewer depths; returns how many samples were removed
+size_t consolidateDeepSamples(DeepOutPixel& pixel, const DeepConsolidation& settings)
+{
+	size_t stride = settings.size;
+	int count = stride > 0 ? pixel.size() / stride : 0;
+
+	if (!settings.enabled || count < 2)
+		return 0;
+
+	DeepScratch& scratch = threadScratch();
+	resizeScratch(scratch.sample_visibility, count, scratch.counters.allocations);
+	float* data = &pixel[0];
+	float* visibility = &scratch.sample_visibility[0];				//how much each sample adds to the accumulated alpha of the pixel
+
+	//merge each sample into the group in front of it, if it is within the depth tolerance or the alpha error budget of that group
+	int kept = 0;
+	float alpha_accum = 0;
+	float group_error = 0;
+
+	for (int s = 0; s < count; s++)
+	{
+		float* sample = data + s * stride;
+		float sample_visibility = sample[settings.alpha] * (1 - alpha_accum);
+		alpha_accum += sample_visibility;
+
+		if (kept > 0)
+		{
+			float* group = data + (kept - 1) * stride;
+
+			if ((sample[settings.front] - group[settings.front] <= settings.depth_tolerance) || (group_error + sample_visibility < settings.alpha_error))
+			{
+				mergeDeepSample(group, sample, settings);
+				visibility[kept - 1] += sample_visibility;
+				group_error += sample_visibility;
+				continue;
+			}
+		}
+
+		if (s != kept)
+			std::copy(sample, sample + stride, data + kept * stride);
+
+		visibility[kept] = sample_visibility;
+		group_error = 0;
+		kept++;
+	}
+
+	//merge the neighbours with the least visible sample among them first, until the sample limit is reached
+	if ((settings.max_samples > 0) && (kept > settings.max_samples))
+	{
+		resizeScratch(scratch.sample_prev, kept, scratch.counters.allocations);
+		resizeScratch(scratch.sample_next, kept, scratch.counters.allocations);
+		resizeScratch(scratch.sample_version, kept, scratch.counters.allocations);
+		int* prev = &scratch.sample_prev[0];
+		int* next = &scratch.sample_next[0];
+		unsigned* version = &scratch.sample_version[0];
+		std::vector<DeepSamplePair>& pairs = scratch.sample_pairs;
+		pairs.clear();
+
+		if (pairs.capacity() < (size_t)kept * 2)		//each merge replaces at most one outdated pair with two new ones
+		{
+			pairs.reserve(kept * 2);
+			scratch.counters.allocations++;
+		}
+
+		for (int s = 0; s < kept; s++)
+		{
+			prev[s] = s - 1;
+			next[s] = s + 1;
+			version[s] = 0;
+		}
+
+		for (int s = 0; s + 1 < kept; s++)
+		{
+			DeepSamplePair pair = {std::min(visibility[s], visibility[s + 1]), s, s + 1, 0, 0};
+			pairs.push_back(pair);
+		}
+
+		std::make_heap(pairs.begin(), pairs.end());
+		int remaining = kept;
+
+		while (remaining > settings.max_samples)
+		{
+			DeepSamplePair pair = pairs.front();
+			std::pop_heap(pairs.begin(), pairs.end());
+			pairs.pop_back();
+
+			if ((version[pair.left] != pair.left_version) || (version[pair.right] != pair.right_version))		//outdated, one of the samples has been merged since
+				continue;
+
+			int left = pair.left;
+			int right = pair.right;
+			mergeDeepSample(data + left * stride, data + right * stride, settings);
+			visibility[left] += visibility[right];
+			version[left]++;
+			version[right]++;
+			next[left] = next[right];
+			if (next[left] < kept)
+				prev[next[left]] = left;
+			remaining--;
+
+			if (prev[left] >= 0)
+			{
+				DeepSamplePair before = {std::min(visibility[prev[left]], visibility[left]), prev[left], left, version[prev[left]], version[left]};
+				pairs.push_back(before);
+				std::push_heap(pairs.begin(), pairs.end());
+			}
+
+			if (next[left] < kept)
+			{
+				DeepSamplePair after = {std::min(visibility[left], visibility[next[left]]), left, next[left], version[left], version[next[left]]};
+				pairs.push_back(after);
+				std::push_heap(pairs.begin(), pairs.end());
+			}
+		}
+
+		int compacted = 0;
+
+		for (int s = 0; s < kept; s = next[s])
+		{
+			if (s != compacted)
+				std::copy(data + s * stride, data + (s + 1) * stride, data + compacted * stride);
+			compacted++;
+		}
+
+		kept = compacted;
 	}
 
-	delete[] sampleCount;
-	delete[] sampleNo;
-	delete[] distance;
-	delete[] alpha;
-	delete[] alpha_accum;
+	pixel.resize(kept * stride);
+	scratch.counters.samples_saved += count - kept;
+
+	return count - kept;
 }
 
 
-void makeDeepPixelTidy(DeepPixel& inPixel, DeepOutPixel& outPixel, const ChannelSet& channels)
+//channel positions for makeDeepPixelTidy, resolved once per box
+//the samples get tidied with the working channels (see deepWorkingChannels), as depth and alpha decide how they get split and merged even if they are not requested; only "channels" get written to the output
+struct DeepTidyLayout
+{
+	ChannelRemap remap;				//from the input to the working channels
+	ChannelRemap copy_remap;		//from the input to the output channels, for pixels that don't get tidied
+	bool valid;						//the input has an alpha, otherwise there is nothing to tidy
+	size_t front;
+	size_t back;
+	size_t alpha;
+	size_t size;					//number of working channels
+	std::vector<size_t> output;		//position of each output channel within a working sample
+	bool identical;					//the output channels are the working channels
+
+	DeepTidyLayout(const ChannelMap& in_channels, const ChannelSet& channels)
+	{
+		ChannelSet working = deepWorkingChannels(channels);
+		ChannelMap working_map(working);
+
+		calculateChannelRemap(in_channels, working, remap);
+		calculateChannelRemap(in_channels, channels, copy_remap);
+		valid = in_channels.contains(Chan_Alpha);
+		front = working_map.chanNo(Chan_DeepFront);
+		back = working_map.chanNo(Chan_DeepBack);
+		alpha = working_map.chanNo(Chan_Alpha);
+		size = working.size();
+
+		foreach (z, channels)
+			output.push_back(working_map.chanNo(z));
+		identical = output.size() == size;
+	}
+};
+
+
+//sums of the parts of all samples that make up one tidy sample
+//with the optical depth u = -log(1 - alpha), splitting a volumetric sample scales u and u / alpha * color by the covered fraction of its depth range, and merging coincident samples adds them up (see "Interpreting OpenEXR Deep Pixels")
+struct DeepTidySum
+{
+	const DeepTidyLayout& layout;
+	float* sum;						//u / alpha * color for all channels
+	float* opaque_sum;				//colors of the opaque samples, which get averaged instead
+	float optical_depth;
+	int count;
+	int opaque_count;
+	const float* single;			//the only sample if it is taken over entirely, so it can be copied unchanged
+	float* sample;					//the tidy sample with all working channels, unless they are the output channels
+
+	DeepTidySum(const DeepTidyLayout& tidy_layout, float* sum_buffer, float* opaque_buffer, float* sample_buffer) : layout(tidy_layout), sum(sum_buffer), opaque_sum(opaque_buffer), sample(sample_buffer) {clear();}
+
+	void clear()
+	{
+		std::fill(sum, sum + layout.size, 0.0f);
+		std::fill(opaque_sum, opaque_sum + layout.size, 0.0f);
+		optical_depth = 0;
+		count = 0;
+		opaque_count = 0;
+		single = 0;
+	}
+
+	//adds the part "fraction" of a sample with optical depth "u" and "color_scale" = u / alpha
+	void add(const float* sample, float u, float color_scale, float fraction)
+	{
+		single = (count == 0) && (fraction == 1) ? sample : 0;
+		count++;
+
+		if (sample[layout.alpha] >= 1)
+		{
+			for (size_t k = 0; k < layout.size; k++)
+				opaque_sum[k] += sample[k];
+			opaque_count++;
+			return;
+		}
+
+		optical_depth += u * fraction;
+		color_scale *= fraction;
+
+		for (size_t k = 0; k < layout.size; k++)
+			sum[k] += sample[k] * color_scale;
+	}
+
+	//appends the tidy sample for the depth range from "front" to "back"
+	void write(DeepOutPixel& outPixel, float front, float back)
+	{
+		if (count == 0)
+			return;
+
+		size_t offset = outPixel.size();
+		float* out = sample;
+
+		if (layout.identical)
+		{
+			outPixel.resize(offset + layout.size);
+			out = &outPixel[offset];
+		}
+
+		if ((count == 1) && single)
+			std::copy(single, single + layout.size, out);
+
+		else if (opaque_count > 0)
+		{
+			for (size_t k = 0; k < layout.size; k++)
+				out[k] = opaque_sum[k] / opaque_count;
+			out[layout.alpha] = 1;
+		}
+
+		else
+		{
+			float alpha = -expm1f(-optical_depth);
+			float scale = ((optical_depth > 1) || (alpha < optical_depth * FLT_MAX)) ? alpha / optical_depth : 1;
+
+			for (size_t k = 0; k < layout.size; k++)
+				out[k] = sum[k] * scale;
+			out[layout.alpha] = alpha;
+		}
+
+		out[layout.front] = front;
+		out[layout.back] = back;
+
+		if (!layout.identical)
+		{
+			size_t out_size = layout.output.size();
+			outPixel.resize(offset + out_size);
+			for (size_t k = 0; k < out_size; k++)
+				outPixel[offset + k] = out[layout.output[k]];
+		}
+
+		clear();
+	}
+};
+
+
+//orders sample indices by their front depth
+struct DeepTidyOrder
+{
+	const float* samples;
+	size_t size;
+	size_t front;
+
+	bool operator()(int a, int b) const {return samples[a * size + front] < samples[b * size + front];}
+};
+
+
+//writes the samples of inPixel to outPixel (closest first) so that none of them overlap: volumetric samples get split at the fronts and backs of all other samples,
+//and the samples that cover the same depth range afterwards get merged; all of this happens in one sweep over the sorted depths, using the thread's scratch memory
+void makeDeepPixelTidy(const DeepPixel& inPixel, DeepOutPixel& outPixel, const DeepTidyLayout& layout)
 {
-	//create sorted list of all sample distances (only front for flat samples, front and back for volumetric samples)
-	std::vector<float> distance_list;
+	if (!layout.valid)
+	{
+		copyDeepPixel(inPixel, outPixel, layout.copy_remap);
+		return;
+	}
 
-	for (int i = 0; i < inPixel.getSampleCount(); i++)
+	DeepScratch& scratch = threadScratch();
+	DeepOutPixel& samples = scratch.tidy_samples;
+	size_t capacity = samples.capacity();
+	samples.clear();
+	copyDeepPixel(inPixel, samples, layout.remap);
+	scratch.counters.allocations += samples.capacity() > capacity;
+
+	size_t stride = layout.size;
+	int count = inPixel.getSampleCount();
+
+	if (count == 0)
+		return;
+
+	resizeScratch(scratch.tidy_order, count, scratch.counters.allocations);
+	resizeScratch(scratch.tidy_depths, count * 2, scratch.counters.allocations);
+	resizeScratch(scratch.tidy_optical_depth, count, scratch.counters.allocations);
+	resizeScratch(scratch.tidy_color_scale, count, scratch.counters.allocations);
+	resizeScratch(scratch.tidy_sum, stride, scratch.counters.allocations);
+	resizeScratch(scratch.tidy_opaque_sum, stride, scratch.counters.allocations);
+	resizeScratch(scratch.tidy_sample, stride, scratch.counters.allocations);
+
+	if (scratch.tidy_active.capacity() < (size_t)count)
 	{
-		distance_list.push_back(inPixel.getOrderedSample(i, Chan_DeepFront));
-		if (inPixel.getOrderedSample(i, Chan_DeepBack) != inPixel.getOrderedSample(i, Chan_DeepFront))
-			distance_list.push_back(inPixel.getOrderedSample(i, Chan_DeepBack));
+		scratch.tidy_active.reserve(count);
+		scratch.counters.allocations++;
 	}
 
-	std::sort(distance_list.begin(), distance_list.end());
+	float* data = &samples[0];
+	int* order = &scratch.tidy_order[0];
+	float* depths = &scratch.tidy_depths[0];
+	float* optical_depth = &scratch.tidy_optical_depth[0];
+	float* color_scale = &scratch.tidy_color_scale[0];
+	std::vector<int>& active = scratch.tidy_active;				//volumetric samples that cover the current depth range
+	active.clear();
+
+	//create sorted list of all sample distances (front and back of each sample)
+	for (int i = 0; i < count; i++)
+	{
+		float* sample = data + i * stride;
+		sample[layout.back] = std::max(sample[layout.back], sample[layout.front]);
+
+		float alpha = std::min(std::max(sample[layout.alpha], 0.0f), 1.0f);
+		optical_depth[i] = -log1pf(-alpha);
+		color_scale[i] = optical_depth[i] < alpha * FLT_MAX ? optical_depth[i] / alpha : 1;
+
+		order[i] = i;
+		depths[i * 2] = sample[layout.front];
+		depths[i * 2 + 1] = sample[layout.back];
+	}
 
-	DeepOutPixel tempPixel_splitting;
-	tempPixel_splitting.clear();
+	DeepTidyOrder by_front = {data, stride, layout.front};
+	std::sort(order, order + count, by_front);
+	std::sort(depths, depths + count * 2);
+	int depth_count = std::unique(depths, depths + count * 2) - depths;
 
-	int sampleNo = 0;
-	bool split = false;
-	ChannelMap myChannelMap(channels);
-	DeepSample tempSample_splitting(myChannelMap);
-	float front;
-	float back;
-	int last_reached_entry = 0;
+	DeepTidySum sum(layout, &scratch.tidy_sum[0], &scratch.tidy_opaque_sum[0], &scratch.tidy_sample[0]);
+	int next = 0;
 
-	//check all volumetric samples for overlapping and split them if necessary
-	while ((sampleNo < inPixel.getSampleCount()) && (split = false))
+	for (int d = 0; d < depth_count; d++)
 	{
-		if (split == false)
+		float z = depths[d];
+
+		//volumetric samples that end here don't cover any of the following ranges
+		size_t kept = 0;
+		for (size_t i = 0; i < active.size(); i++)
+		{
+			if (data[active[i] * stride + layout.back] > z)
+				active[kept++] = active[i];
+		}
+		active.resize(kept);
+
+		//merge all flat samples at this depth, and start the volumetric ones
+		while ((next < count) && (data[order[next] * stride + layout.front] == z))
+		{
+			int i = order[next++];
+			const float* sample = data + i * stride;
+
+			if (sample[layout.back] == z)
+				sum.add(sample, optical_depth[i], color_scale[i], 1);
+			else
+				active.push_back(i);
+		}
+
+		sum.write(outPixel, z, z);
+
+		//merge the parts of all volumetric samples between this and the next depth
+		if ((d + 1 < depth_count) && !active.empty())
 		{
-			front = inPixel.getOrderedSample(sampleNo, Chan_DeepFront);
-			back = inPixel.getOrderedSample(sampleNo, Chan_DeepBack);
+			float z_next = depths[d + 1];
+
+			for (size_t i = 0; i < active.size(); i++)
+			{
+				const float* sample = data + active[i] * stride;
+				float fraction = (sample[layout.front] == z) && (sample[layout.back] == z_next) ? 1 : (z_next - z) / (sample[layout.back] - sample[layout.front]);
+				sum.add(sample, optical_depth[active[i]], color_scale[active[i]], fraction);
+			}
+
+			sum.write(outPixel, z, z_next);
 		}
 	}
-	
-	DeepOutPixel tempPixel_merging;
-	tempPixel_merging.clear();
-}
\ No newline at end of file
+}
@@ -27,6 +27,7 @@ static const char* const bbox_names[] = {"union", "B side", "A side", 0};
 #include "DDImage/Knobs.h"
 #include "DDImage/Pixel.h"
 #include "DDImage/RequestData.h"
+#include "DDImage/Row.h"
 #include "msDeepFunctions.h"
 
 
@@ -42,6 +43,17 @@ class msDeepKeymix : public DeepOnlyOp
 		bool _invert_mask;
 		float _mix;
 		int _bbox;
+		bool _drop_hidden;
+		float _opacity_cutoff;
+		bool _consolidate;
+		float _depth_tolerance;
+		float _alpha_error;
+		int _max_samples;
+		int _max_threads;
+		const char* _stats_text;
+		const char* _stats_file;
+
+		DeepStats stats;
 
 	public:
 		int minimum_inputs() const {return 3;}
@@ -53,15 +65,27 @@ class msDeepKeymix : public DeepOnlyOp
 			_invert_mask = false;
 			_mix = 1;
 			_bbox = 0;
+			_drop_hidden = false;
+			_opacity_cutoff = 1;
+			_consolidate = false;
+			_depth_tolerance = 0;
+			_alpha_error = 0;
+			_max_samples = 0;
+			_max_threads = 1;
+			_stats_text = 0;
+			_stats_file = 0;
 		}
 	
 		virtual void knobs(Knob_Callback);
+		int knob_changed(Knob*);
 		const char* input_label (int, char*) const;
 		bool test_input(int, Op*) const;		
 		virtual Op* default_input(int) const;
 		void _validate(bool);
+		void _close();
 		virtual void getDeepRequests(Box, const ChannelSet&, int, std::vector<RequestData>&);
 		virtual bool doDeepEngine(Box, const ChannelSet&, DeepOutputPlane&);
+		void readMask(const Box&, float*);
 		
 		DeepOp* inputB() {return dynamic_cast<DeepOp*>(Op::input(0));}
 		DeepOp* inputA() {return dynamic_cast<DeepOp*>(Op::input(1));}
@@ -84,6 +108,59 @@ void msDeepKeymix::knobs(Knob_Callback f)
 	Tooltip(f, "Dissolve between B-only at 0 and the full keymix at 1");
 	Enumeration_knob(f, &_bbox, bbox_names, "bbox", "Set BBox to");
 	Tooltip(f, "Clip one input to match the other if wanted");
+
+	Divider(f, "");
+
+	Bool_knob(f, &_drop_hidden, "drop_hidden", "drop hidden samples");
+	Tooltip(f, "Where A and B get mixed, remove samples that are behind others with alpha 1 (i.e. those that are entirely occluded). Depending on the image content, this will make this node and subsequent Deep nodes render faster.");
+	SetFlags(f, Knob::STARTLINE);
+
+	Float_knob(f, &_opacity_cutoff, "opacity_cutoff", "opacity cutoff");
+	Tooltip(f, "If \"drop hidden samples\" is activated, the merge of a pixel also ends as soon as its accumulated alpha reaches this value, and its last sample is made opaque to cover the rest. This saves going through all remaining samples of dense hair or volumes, whose accumulated alpha only approaches 1. The alpha of a pixel can change by at most 1 minus this value. At 1, merges only end at opaque samples.");
+	SetRange(f, 0.99, 1);
+
+	Divider(f, "");
+
+	Bool_knob(f, &_consolidate, "consolidate", "consolidate samples");
+	Tooltip(f, "Merge neighbouring samples of the pixels where A and B get mixed, so subsequent Deep nodes have fewer samples to process. The merged samples are composited over each other, so the flattened image stays the same, only the alpha gets distributed over fewer depths. Pixels that are piped through are left as they are.");
+	SetFlags(f, Knob::STARTLINE);
+
+	Float_knob(f, &_depth_tolerance, "depth_tolerance", "depth tolerance");
+	Tooltip(f, "If \"consolidate samples\" is activated, samples whose fronts are no further apart than this distance are merged.");
+	SetRange(f, 0, 1);
+
+	Float_knob(f, &_alpha_error, "alpha_error", "alpha error");
+	Tooltip(f, "If \"consolidate samples\" is activated, neighbouring samples are also merged regardless of their distance, as long as less accumulated alpha than this gets moved to the front of the merged sample. 0 turns this off.");
+	SetRange(f, 0, 0.05);
+
+	Int_knob(f, &_max_samples, "max_samples", "max samples");
+	Tooltip(f, "If \"consolidate samples\" is activated, the neighbours with the least visible sample among them keep getting merged until each pixel has no more than this many samples. 0 means no limit.");
+
+	Divider(f, "");
+
+	Int_knob(f, &_max_threads, "max_threads", "max threads");
+	Tooltip(f, "Maximum number of threads that render the rows of a single requested box in parallel. 1, the default, renders each box on the thread that requested it, as Nuke already renders several boxes at once; more threads mostly help when only a few large boxes are requested, e.g. by a DeepWrite. 0 uses all cores. The result is the same for any number of threads.");
+	SetFlags(f, Knob::STARTLINE);
+
+	deepStatsKnobs(f, &_stats_text, &_stats_file);
+}
+
+
+int msDeepKeymix::knob_changed(Knob* k)
+{
+	if (deepStatsKnobChanged(this, k, stats, 0, _stats_file))
+		return 1;
+
+	if(k == &Knob::showPanel || k->is("drop_hidden") || k->is("consolidate"))
+	{
+		knob("opacity_cutoff")->enable(_drop_hidden);
+		knob("depth_tolerance")->enable(_consolidate);
+		knob("alpha_error")->enable(_consolidate);
+		knob("max_samples")->enable(_consolidate);
+		return 1;
+	}
+
+	return 0;
 }
 
 
@@ -132,6 +209,9 @@ void msDeepKeymix::_validate(bool for_real)
 		if (inputA())
 		{
 			inputA()->validate(for_real);
+
+			if (inputMask())
+				inputMask()->validate(for_real);
 			
 			Box bbox;
 			if (_bbox == 0)
@@ -160,6 +240,12 @@ void msDeepKeymix::_validate(bool for_real)
 }
 
 
+void msDeepKeymix::_close()
+{
+	writeDeepStats(this, stats, 0, _stats_file);
+}
+
+
 void msDeepKeymix::getDeepRequests(Box box, const ChannelSet& channels, int count, std::vector<RequestData>& requests)
 {
 	if (inputB())
@@ -192,106 +278,123 @@ bool msDeepKeymix::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputP
 
 	outPlane = DeepOutputPlane(channels, box);
 
+	//channel layouts of the inputs, resolved once for the whole box, so samples that are piped through can be copied in bulk
+	ChannelRemap remapB;
+	calculateChannelRemap(ChannelMap(inPlaneB.channels()), channels, remapB);
+
 
 	if (inputA())
 	{
 		if (!inputA()->deepEngine(box, inputA()->deepInfo().channels(), inPlaneA))
 			return false;
 
-		for (Box::iterator it = box.begin(); it != box.end(); it++)
-		{	
-			float mask_value = 0;
-			if(inputMask())
-			{
-				mask_value = clamp(inputMask()->at(it.x, it.y, _mask_channel));
-				if (_invert_mask)
-					mask_value = 1 - mask_value;
-				mask_value *= _mix;
-			}
+		ChannelRemap remapA;
+		calculateChannelRemap(ChannelMap(inPlaneA.channels()), channels, remapA);
 
-			//if mask channel is 0, simply pipe through input B
-			if (mask_value == 0)
-			{
-				DeepPixel inPixel = inPlaneB.getPixel(it);
-				DeepOutPixel outPixel(inPixel.getSampleCount() * channels.size());
+		//mask values of all pixels in the box, in the same order as the box iterator
+		std::vector<float> mask(box.w() * box.h(), 0.0f);
+		if (inputMask() && !mask.empty())
+			readMask(box, &mask[0]);
 
-				for (int sampleNo = 0; sampleNo < inPixel.getSampleCount(); sampleNo++)
-				{
-					foreach (z, channels)
-					{
-						if (inPixel.channels().contains(z))
-							outPixel.push_back(inPixel.getUnorderedSample(sampleNo, z));
-						else
-							outPixel.push_back(0);
-					}
-				}
+		DeepStatsScope stats_scope(stats, channels);
+		stats_scope.read(inPlaneB);
+		stats_scope.read(inPlaneA);
 
-				outPlane.addPixel(outPixel);
-			}
+		DeepConsolidation consolidation(channels, _consolidate, _depth_tolerance, _alpha_error, _max_samples);
+
+		auto render = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
+		{
+			DeepPixelSource source(channels);
+			const float* mask_value = &mask[(y_begin - box.y()) * box.w()];
 
-			//if mask channel is 1, simply pipe through input A
-			else if (mask_value == 1)
+			for (int y = y_begin; y < y_end; y++)
 			{
-				DeepPixel inPixel = inPlaneA.getPixel(it);
-				DeepOutPixel outPixel(inPixel.getSampleCount() * channels.size());
+				for (int x = box.x(); x < box.r(); x++, mask_value++)
+				{	
+					DeepOutPixel& outPixel = *outPixels++;
+					outPixel.clear();
 
-				for (int sampleNo = 0; sampleNo < inPixel.getSampleCount(); sampleNo++)
-				{
-					foreach (z, channels)
-					{
-						if (inPixel.channels().contains(z))
-							outPixel.push_back(inPixel.getUnorderedSample(sampleNo, z));
-						else
-							outPixel.push_back(0);
-					}
-				}
+					//if mask channel is 0, simply pipe through input B
+					if (*mask_value == 0)
+						copyDeepPixel(inPlaneB.getPixel(y, x), outPixel, remapB);
 
-				outPlane.addPixel(outPixel);
-			}
+					//if mask channel is 1, simply pipe through input A
+					else if (*mask_value == 1)
+						copyDeepPixel(inPlaneA.getPixel(y, x), outPixel, remapA);
 
-			//if mask channel is between 0 and 1, combine pixels from inputs A and B
-			else
-			{
-				std::vector<DeepPixel> inPixels;
-				inPixels.push_back(inPlaneB.getPixel(it.y, it.x));
-				inPixels.push_back(inPlaneA.getPixel(it.y, it.x));
-
-				DeepOutPixel outPixel;
-				outPixel.clear();
+					//if mask channel is between 0 and 1, combine pixels from inputs A and B
+					else
+					{
+						source.clear();
+						source.push_back(inPlaneB.getPixel(y, x));
+						source.push_back(inPlaneA.getPixel(y, x));
 
-				float weight[2];
-				weight[0] = 1 - mask_value;
-				weight[1] = mask_value;
+						float weight[2];
+						weight[0] = 1 - *mask_value;
+						weight[1] = *mask_value;
 
-				combineDeepPixels(inPixels, outPixel, channels, 2, weight, false, false, 0);
-			
-				outPlane.addPixel(outPixel);
+						mergeDeepSamples(source, outPixel, channels, 2, weight, _drop_hidden, false, 0, _opacity_cutoff);
+						consolidateDeepSamples(outPixel, consolidation);
+					}
+				}
 			}
-		}
+		};
+
+		renderDeepRows(box, _max_threads, render, outPlane);
 	}
 
 	else
 	{
-		for (Box::iterator it = box.begin(); it != box.end(); it++)
-		{	
-			DeepPixel inPixel = inPlaneB.getPixel(it);
-			DeepOutPixel outPixel(inPixel.getSampleCount() * channels.size());
+		DeepStatsScope stats_scope(stats, channels);
+		stats_scope.read(inPlaneB);
 
-			for (int sampleNo = 0; sampleNo < inPixel.getSampleCount(); sampleNo++)
+		auto render = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
+		{
+			for (int y = y_begin; y < y_end; y++)
 			{
-				foreach (z, channels)
-				{
-					outPixel.push_back(inPixel.getUnorderedSample(sampleNo, z));
+				for (int x = box.x(); x < box.r(); x++)
+				{	
+					DeepOutPixel& outPixel = *outPixels++;
+					outPixel.clear();
+					copyDeepPixel(inPlaneB.getPixel(y, x), outPixel, remapB);
 				}
 			}
+		};
 
-			outPlane.addPixel(outPixel);
-		}
+		renderDeepRows(box, _max_threads, render, outPlane);
 	}
 	
 	return true;
 }
 
 
+//reads the mask channel for the whole box row by row, then applies clamping, inverting and mixing to all values at once
+void msDeepKeymix::readMask(const Box& box, float* mask)
+{
+	int width = box.w();
+	Row row(box.x(), box.r());
+
+	for (int y = box.y(); y < box.t(); y++)
+	{
+		inputMask()->get(y, box.x(), box.r(), _mask_channel, row);
+
+		const float* values = row[_mask_channel] + box.x();
+		float* mask_row = mask + (y - box.y()) * width;
+
+		for (int x = 0; x < width; x++)
+			mask_row[x] = clamp(values[x]);
+	}
+
+	int size = width * box.h();
+
+	if (_invert_mask)
+		for (int i = 0; i < size; i++)
+			mask[i] = (1 - mask[i]) * _mix;
+	else
+		for (int i = 0; i < size; i++)
+			mask[i] *= _mix;
+}
+
+
 static Op* build(Node* node) {return new msDeepKeymix(node);}
 const Op::Description msDeepKeymix::d("msDeepKeymix", 0, build);
\ No newline at end of file
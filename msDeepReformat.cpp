@@ -9,6 +9,7 @@ To view a copy of this license, visit http://creativecommons.org/licenses/by/3.0
 
 static const char* const CLASS = "msDeepReformat";
 static const char* const HELP =	"Works like Nuke's regular DeepReformat, but uses a cubic filter.\n\n"
+								"Images that are only moved by whole pixels (resize type \"none\", or a scale of exactly 1) are passed through without filtering, which costs next to nothing.\n\n"
 
 								"Version: 1.0.0\n"
 								"Author: Mark Spindler\n"
@@ -34,6 +35,22 @@ using namespace DD::Image;
 
 
 
+//footprint of the cubic filter along one axis: the input columns (or rows) each output column (or row) reads, together with their weights
+struct FilterTable
+{
+	int origin;						//first output column/row covered by the table
+	std::vector<int> first;			//index of the first tap of each output column/row in "position" and "weight", plus one entry marking the end of the last one
+	std::vector<int> position;		//input column/row of each tap
+	std::vector<float> weight;		//unnormalized weight of each tap
+	bool regular;					//all output columns/rows have the same taps with the same weights, only shifted, as for integer downscales
+
+	bool covers(int begin, int end) const
+	{
+		return (begin >= origin) && (end <= origin + (int)first.size() - 1);
+	}
+};
+
+
 class msDeepReformat : public DeepOnlyOp
 {
 	private:
@@ -50,14 +67,29 @@ class msDeepReformat : public DeepOnlyOp
 		bool _drop_hidden;
 		bool _drop_transparent;
 		float _threshold;
+		float _opacity_cutoff;
+		bool _consolidate;
+		float _depth_tolerance;
+		float _alpha_error;
+		int _max_samples;
+		int _max_threads;
+		int _cache_memory;
+		const char* _stats_text;
+		const char* _stats_file;
 
 		Matrix4 matrix;
 		float scale_factor[2];
+		FilterTable column_taps;
+		FilterTable row_taps;
+		bool passthrough;				//every output pixel is a single input pixel moved by a fixed whole number of pixels, so the input is passed through without footprints
 
 		FormatPair formats;
 		Format format;
 		Format full_size_format;
 
+		DeepTileCache tile_cache;
+		DeepStats stats;
+
 		enum {to_format, to_box, scale};
 		enum {none, width, height, fit, fill, distort};
 
@@ -81,6 +113,15 @@ class msDeepReformat : public DeepOnlyOp
 			_drop_hidden = true;
 			_drop_transparent = true;
 			_threshold = 0;
+			_opacity_cutoff = 1;
+			_consolidate = false;
+			_depth_tolerance = 0;
+			_alpha_error = 0;
+			_max_samples = 0;
+			_max_threads = 1;
+			_cache_memory = 0;
+			_stats_text = 0;
+			_stats_file = 0;
 		}
 	
 		virtual void knobs(Knob_Callback);
@@ -88,8 +129,13 @@ class msDeepReformat : public DeepOnlyOp
 		bool test_input(int, Op*) const;		
 		virtual Op* default_input(int) const;
 		void _validate(bool);
+		void _close();
 		virtual void getDeepRequests(Box, const ChannelSet&, int, std::vector<RequestData>&);
 		void calculateMatrix();
+		float transformAxis(int, float);
+		void calculateFilterTable(int, int, int, FilterTable&);
+		const FilterTable& filterTable(int, int, int, FilterTable&);
+		Box inputBox(const Box&);
 		virtual bool doDeepEngine(Box, const ChannelSet&, DeepOutputPlane&);
 
 		DeepOp* input0() {return dynamic_cast<DeepOp*>(Op::input(0));}
@@ -126,7 +172,7 @@ void msDeepReformat::knobs(Knob_Callback f)
 
 	Enumeration_knob(f, &_resize_type, resize_types, "resize", "resize type");
 	Tooltip(f,	"Choose which direction controls the scaling factor:\n"
-				"none: don't change the pixels\n"
+				"none: don't change the pixels, which are passed through as they are, without dropping or consolidating samples\n"
 				"width: scale so it fills the output width\n"
 				"height: scale so it fills the output height\n"
 				"fit: smaller of width or height\n"
@@ -149,11 +195,47 @@ void msDeepReformat::knobs(Knob_Callback f)
 	Float_knob(f, &_threshold, "threshold", "threshold");
 	Tooltip(f, "If \"drop transparent samples\" is activated, any samples with an alpha value equal or smaller than this threshold will be removed.");
 	SetRange(f, 0, 1);
+
+	Float_knob(f, &_opacity_cutoff, "opacity_cutoff", "opacity cutoff");
+	Tooltip(f, "If \"drop hidden samples\" is activated, the merge of a pixel also ends as soon as its accumulated alpha reaches this value, and its last sample is made opaque to cover the rest. This saves going through all remaining samples of dense hair or volumes, whose accumulated alpha only approaches 1. The alpha of a pixel can change by at most 1 minus this value. At 1, merges only end at opaque samples.");
+	SetRange(f, 0.99, 1);
+
+	Divider(f, "");
+
+	Bool_knob(f, &_consolidate, "consolidate", "consolidate samples");
+	Tooltip(f, "Merge neighbouring output samples, so subsequent Deep nodes have fewer samples to process. The merged samples are composited over each other, so the flattened image stays the same, only the alpha gets distributed over fewer depths.");
+	SetFlags(f, Knob::STARTLINE);
+
+	Float_knob(f, &_depth_tolerance, "depth_tolerance", "depth tolerance");
+	Tooltip(f, "If \"consolidate samples\" is activated, samples whose fronts are no further apart than this distance are merged.");
+	SetRange(f, 0, 1);
+
+	Float_knob(f, &_alpha_error, "alpha_error", "alpha error");
+	Tooltip(f, "If \"consolidate samples\" is activated, neighbouring samples are also merged regardless of their distance, as long as less accumulated alpha than this gets moved to the front of the merged sample. 0 turns this off.");
+	SetRange(f, 0, 0.05);
+
+	Int_knob(f, &_max_samples, "max_samples", "max samples");
+	Tooltip(f, "If \"consolidate samples\" is activated, the neighbours with the least visible sample among them keep getting merged until each pixel has no more than this many samples. 0 means no limit.");
+
+	Divider(f, "");
+
+	Int_knob(f, &_max_threads, "max_threads", "max threads");
+	Tooltip(f, "Maximum number of threads that render the rows of a single requested box in parallel. 1, the default, renders each box on the thread that requested it, as Nuke already renders several boxes at once; more threads mostly help when only a few large boxes are requested, e.g. by a DeepWrite. 0 uses all cores. The result is the same for any number of threads.");
+	SetFlags(f, Knob::STARTLINE);
+
+	Int_knob(f, &_cache_memory, "cache_memory", "cache memory (MB)");
+	Tooltip(f, "Keep up to this much memory of finished boxes, so viewing the same frame again with unchanged inputs and knobs doesn't filter it again. The least recently used boxes are dropped once the limit is reached. 0 turns the cache off.");
+	SetFlags(f, Knob::NO_RERENDER);
+
+	deepStatsKnobs(f, &_stats_text, &_stats_file);
 }
 
 
 int msDeepReformat::knob_changed(Knob* k)
 {
+	if (deepStatsKnobChanged(this, k, stats, &tile_cache, _stats_file))
+		return 1;
+
 	if (k == &Knob::showPanel)
 	{
 		knob("format")->visible(_type == to_format);
@@ -166,6 +248,10 @@ int msDeepReformat::knob_changed(Knob* k)
 		knob("box_height")->enable(_box_fixed);
 		
 		knob("threshold")->enable(_drop_transparent);
+		knob("opacity_cutoff")->enable(_drop_hidden);
+		knob("depth_tolerance")->enable(_consolidate);
+		knob("alpha_error")->enable(_consolidate);
+		knob("max_samples")->enable(_consolidate);
 
 		return 1;
 	}
@@ -189,11 +275,27 @@ int msDeepReformat::knob_changed(Knob* k)
 		return 1;
 	}
 
+	if(k->is("drop_hidden"))
+	{
+		knob("opacity_cutoff")->enable(_drop_hidden);
+		return 1;
+	}
+
 	if(k->is("drop_transparent"))
 	{
 		knob("threshold")->enable(_drop_transparent);
 		return 1;
 	}
+
+	if(k->is("consolidate"))
+	{
+		knob("depth_tolerance")->enable(_consolidate);
+		knob("alpha_error")->enable(_consolidate);
+		knob("max_samples")->enable(_consolidate);
+		return 1;
+	}
+
+	return 0;
 }
 
 
@@ -235,27 +337,35 @@ void msDeepReformat::_validate(bool for_real)
 		_deepInfo = input0()->deepInfo();
 		_deepInfo.setFormats(formats);
 		_deepInfo.setBox(myBox);
+
+		//the filter footprints only depend on the output column or row, so they are calculated once for the whole output box
+		calculateFilterTable(0, myBox.x(), myBox.r(), column_taps);
+		calculateFilterTable(1, myBox.y(), myBox.t(), row_taps);
+
+		//resize type none, or a scale of exactly 1 with a shift by whole pixels
+		passthrough = column_taps.regular && row_taps.regular && (column_taps.first[1] == 1) && (row_taps.first[1] == 1);
 	}
 
 	else
+	{
 		_deepInfo = DeepInfo();
+		passthrough = false;
+	}
+
+	tile_cache.setBudget((size_t)std::max(_cache_memory, 0) << 20);
+}
+
+
+void msDeepReformat::_close()
+{
+	writeDeepStats(this, stats, &tile_cache, _stats_file);
 }
 
 
 void msDeepReformat::getDeepRequests(Box box, const ChannelSet& channels, int count, std::vector<RequestData>& requests)
 {
-	Vector2 bottom_left(input_format().x(), input_format().y());
-	Vector2 top_right(input_format().r(), input_format().t());
-	bottom_left = matrix.transform(bottom_left);
-	top_right = matrix.transform(top_right);
-
-	Box myBox = box;
-	myBox.x(floor(std::min(bottom_left.x, top_right.x)) - ceil(scale_factor[0]));
-	myBox.y(floor(std::min(bottom_left.y, top_right.y)) - ceil(scale_factor[1]));
-	myBox.r(ceil(std::max(bottom_left.x, top_right.x)) + ceil(scale_factor[0]));
-	myBox.t(ceil(std::max(bottom_left.y, top_right.y)) + ceil(scale_factor[1]));
-
-	requests.push_back(RequestData(input0(), myBox, channels, count));
+	if (input0())
+		requests.push_back(RequestData(input0(), inputBox(box), channels, count));
 }
 
 
@@ -399,113 +509,299 @@ void msDeepReformat::calculateMatrix()
 }
 
 
-bool msDeepReformat::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+//the matrix only scales and translates, so each coordinate of a transformed point only depends on the same coordinate of the original point
+float msDeepReformat::transformAxis(int axis, float position)
 {
-	if (!input0())
-		return false;
-
-	DeepPlane inPlane;
-
-	Vector2 bottom_left(box.x(), box.y());
-	Vector2 top_right(box.r(), box.t());
-	bottom_left = matrix.transform(bottom_left);
-	top_right = matrix.transform(top_right);
-	
-	Box myBox;
-	myBox.x(floor(std::min(bottom_left.x, top_right.x)) - ceil(scale_factor[0]));
-	myBox.y(floor(std::min(bottom_left.y, top_right.y)) - ceil(scale_factor[1]));
-	myBox.r(ceil(std::max(bottom_left.x, top_right.x)) + ceil(scale_factor[0]));
-	myBox.t(ceil(std::max(bottom_left.y, top_right.y)) + ceil(scale_factor[1]));
+	Vector2 point(position, position);
+	point = matrix.transform(point);
 
-	if (!input0()->deepEngine(myBox, channels, inPlane))
-		return false;
+	return (axis == 0) ? point.x : point.y;
+}
 
-    outPlane = DeepOutputPlane(channels, box);
 
-	for (Box::iterator it = box.begin(); it != box.end(); it++)
-	{	
-		int x = it.x;
-		int y = it.y;
+void msDeepReformat::calculateFilterTable(int axis, int begin, int end, FilterTable& table)
+{
+	table.origin = begin;
+	table.first.clear();
+	table.position.clear();
+	table.weight.clear();
 
-		Vector2 center(x, y);
-		bottom_left.set(x - 1, y - 1);
-		top_right.set(x + 1, y + 1);
+	for (int x = begin; x < end; x++)
+	{
+		table.first.push_back(table.position.size());
 
-		center = matrix.transform(center);
-		bottom_left = matrix.transform(bottom_left);
-		top_right = matrix.transform(top_right);
+		float center = transformAxis(axis, x);
 
-		std::vector<DeepPixel> inPixels;
-		int amount;
-		
 		if (_resize_type == none)
 		{
-			amount = 1;
+			table.position.push_back((int)center);
+			table.weight.push_back(1);
+			continue;
 		}
 
-		else 
+		float bottom_left = transformAxis(axis, x - 1);
+		float top_right = transformAxis(axis, x + 1);
+
+		for (int i = floor(std::min(bottom_left, top_right)); i <= ceil(std::max(bottom_left, top_right)); i++)
 		{
-			amount = (ceil(std::max(bottom_left.x, top_right.x)) - floor(std::min(bottom_left.x, top_right.x)) + 1) * (ceil(std::max(bottom_left.y, top_right.y)) - floor(std::min(bottom_left.y, top_right.y)) + 1);
+			float dist = std::abs(center - i) / std::max(scale_factor[axis], 1.0f);
+
+			if (dist < 1)																	//taps outside the filter have a weight of 0 and are skipped entirely
+			{
+				table.position.push_back(i);
+				table.weight.push_back(2 * pow(dist, 3) - 3 * pow(dist, 2) + 1);		//cubic interpolation: 2|x| - 3|x| + 1
+			}
 		}
-		
-		float* weight = new float[amount];
+	}
 
+	table.first.push_back(table.position.size());
 
-		if (_resize_type == none)
+	//integer ratios repeat the footprint of the first output column/row at a fixed distance, which only holds if the weights match exactly
+	//a single column/row has nothing to repeat, so it doesn't count as regular and can't be mistaken for a passthrough
+	int taps = (end - begin > 1) ? table.first[1] : 0;
+	table.regular = taps > 0;
+
+	for (int x = 1; (x < end - begin) && table.regular; x++)
+	{
+		int first = table.first[x];
+		int shift = table.position[first] - table.position[0];
+		table.regular = (table.first[x + 1] - first == taps) && (shift == x * (table.position[taps] - table.position[0]));
+
+		for (int i = 0; (i < taps) && table.regular; i++)
+			table.regular = (table.position[first + i] == table.position[i] + shift) && (table.weight[first + i] == table.weight[i]);
+	}
+}
+
+
+//returns the footprints calculated in _validate, unless the range reaches beyond the output bounding box; in that case they are calculated into "local"
+const FilterTable& msDeepReformat::filterTable(int axis, int begin, int end, FilterTable& local)
+{
+	FilterTable& table = (axis == 0) ? column_taps : row_taps;
+
+	if (table.covers(begin, end))
+		return table;
+
+	calculateFilterTable(axis, begin, end, local);
+	return local;
+}
+
+
+//the input region read by the filter footprints of all pixels in "box", i.e. exactly what doDeepEngine needs for this box
+Box msDeepReformat::inputBox(const Box& box)
+{
+	FilterTable local_column_taps;
+	FilterTable local_row_taps;
+	const FilterTable& columns = filterTable(0, box.x(), box.r(), local_column_taps);
+	const FilterTable& rows = filterTable(1, box.y(), box.t(), local_row_taps);
+
+	int range[2][2];
+	const FilterTable* tables[2] = {&columns, &rows};
+	int begin[2] = {box.x(), box.y()};
+	int end[2] = {box.r(), box.t()};
+
+	for (int axis = 0; axis < 2; axis++)
+	{
+		const FilterTable& table = *tables[axis];
+		range[axis][0] = std::numeric_limits<int>::max();
+		range[axis][1] = std::numeric_limits<int>::min();
+
+		for (int i = table.first[begin[axis] - table.origin]; i < table.first[end[axis] - table.origin]; i++)
 		{
-			inPixels.push_back(inPlane.getPixel((int)center.y, (int)center.x));
-			weight[0] = 1;
+			range[axis][0] = std::min(range[axis][0], table.position[i]);
+			range[axis][1] = std::max(range[axis][1], table.position[i] + 1);
 		}
 
-		else
+		if (range[axis][0] > range[axis][1])				//empty box
+			range[axis][0] = range[axis][1] = begin[axis];
+	}
+
+	return Box(range[0][0], range[1][0], range[0][1], range[1][1]);
+}
+
+
+bool msDeepReformat::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+	if (!input0())
+		return false;
+
+	if (tile_cache.find(hash(), box, channels, outPlane))
+		return true;
+
+	DeepPlane inPlane;
+
+	if (!input0()->deepEngine(inputBox(box), channels, inPlane))
+		return false;
+
+	DeepStatsScope stats_scope(stats, channels);
+    outPlane = DeepOutputPlane(channels, box);
+
+	FilterTable local_column_taps;
+	FilterTable local_row_taps;
+	const FilterTable* columns = &filterTable(0, box.x(), box.r(), local_column_taps);
+	const FilterTable* rows = &filterTable(1, box.y(), box.t(), local_row_taps);
+
+	//pixels that are only moved are copied from the input as they are, like a keymix pipes its inputs through; the requested input box is already the output box moved the same way
+	//dropping or consolidating samples still applies to a single pixel, so if any of that is turned on, each pixel is merged on its own instead, just like a footprint of one tap would be
+	if (passthrough)
+	{
+		stats_scope.read(inPlane);
+		ChannelRemap remap;
+		calculateChannelRemap(ChannelMap(inPlane.channels()), channels, remap);
+
+		bool merge = _drop_hidden || _drop_transparent || _consolidate;
+		const float weight = 1;
+		DeepConsolidation consolidation(channels, _consolidate, _depth_tolerance, _alpha_error, _max_samples);
+
+		auto copy = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
 		{
-			int counter = 0;
-			float weight_sum = 0;
+			DeepPixelSource source(channels);
 
-			for (int i = floor(std::min(bottom_left.x, top_right.x)); i <= ceil(std::max(bottom_left.x, top_right.x)); i++)
+			for (int y = y_begin; y < y_end; y++)
 			{
-				for (int j = floor(std::min(bottom_left.y, top_right.y)); j <= ceil(std::max(bottom_left.y, top_right.y)); j++)
+				int row = rows->position[rows->first[y - rows->origin]];
+
+				for (int x = box.x(); x < box.r(); x++)
 				{
-					inPixels.push_back(inPlane.getPixel(j, i));
+					DeepPixel inPixel = inPlane.getPixel(row, columns->position[columns->first[x - columns->origin]]);
+					DeepOutPixel& outPixel = *outPixels++;
+					outPixel.clear();
+
+					if (!merge)
+					{
+						copyDeepPixel(inPixel, outPixel, remap);
+						continue;
+					}
+
+					source.clear();
+					source.push_back(inPixel);
+					mergeDeepSamples(source, outPixel, channels, 1, &weight, _drop_hidden, _drop_transparent, _threshold, _opacity_cutoff);
+					consolidateDeepSamples(outPixel, consolidation);
+				}
+			}
+		};
 
-					float x_weight;
-					float y_weight;
+		renderDeepRows(box, _max_threads, copy, outPlane);
 
-					float x_dist = abs(center.x - i) / std::max(scale_factor[0], 1.0f);
-					float y_dist = abs(center.y - j) / std::max(scale_factor[1], 1.0f);
+		return true;
+	}
 
-					if (x_dist < 1)
-						x_weight = 2 * pow(x_dist, 3) - 3 * pow(x_dist, 2) + 1;		//cubic interpolation: 2|x| - 3|x| + 1
-					else
-						x_weight = 0;
+	//gather all input samples once, then find the pixels of each footprint by their position in the arena
+	DeepScratch& scratch = threadScratch();
+	DeepSampleArena& arena = scratch.arena;
+	gatherDeepSamples(inPlane, channels, arena, scratch.counters);
 
-					if (y_dist < 1)
-						y_weight = 2 * pow(y_dist, 3) - 3 * pow(y_dist, 2) + 1;
-					else
-						y_weight = 0;
+	//scratch memory for the footprint of each pixel, large enough for the biggest footprint in the box
+	int max_taps[2] = {0, 0};
 
-					weight[counter] = x_weight * y_weight;
-					weight_sum += weight[counter];
+	for (int x = box.x(); x < box.r(); x++)
+		max_taps[0] = std::max(max_taps[0], columns->first[x - columns->origin + 1] - columns->first[x - columns->origin]);
 
-					counter++;
-				}
-			}
+	for (int y = box.y(); y < box.t(); y++)
+		max_taps[1] = std::max(max_taps[1], rows->first[y - rows->origin + 1] - rows->first[y - rows->origin]);
 
-			//normalize weights, so their sum equals 1
-			if (weight_sum > 0)
+	//if the footprints are regular along both axes, all pixels share one footprint that only gets shifted across the arena, so its offsets and normalized weights are calculated once for the box
+	bool regular = columns->regular && rows->regular;
+	std::vector<size_t>& tap_offset = scratch.tap_offset;
+	std::vector<float>& tap_weight = scratch.tap_weight;
+	int regular_taps = 0;
+
+	if (regular)
+	{
+		int column = box.x() - columns->origin;
+		int row = box.y() - rows->origin;
+		size_t base = arena.pixel(rows->position[rows->first[row]], columns->position[columns->first[column]]);
+		float weight_sum = 0;
+
+		resizeScratch(tap_offset, max_taps[0] * max_taps[1], scratch.counters.allocations);
+		resizeScratch(tap_weight, max_taps[0] * max_taps[1], scratch.counters.allocations);
+
+		for (int i = columns->first[column]; i < columns->first[column + 1]; i++)
+		{
+			for (int j = rows->first[row]; j < rows->first[row + 1]; j++)
 			{
-				weight_sum = 1 / weight_sum;
-				for (int i = 0; i < amount; i++)
-					weight[i] *= weight_sum;
+				tap_offset[regular_taps] = arena.pixel(rows->position[j], columns->position[i]) - base;
+				tap_weight[regular_taps] = columns->weight[i] * rows->weight[j];
+				weight_sum += tap_weight[regular_taps];
+				regular_taps++;
 			}
 		}
 
-
-		DeepOutPixel outPixel;
-		outPixel.clear();
-		combineDeepPixels(inPixels, outPixel, channels, amount, weight, _drop_hidden, _drop_transparent, _threshold);
-		outPlane.addPixel(outPixel);
+		if (weight_sum > 0)
+		{
+			weight_sum = 1 / weight_sum;
+			for (int i = 0; i < regular_taps; i++)
+				tap_weight[i] *= weight_sum;
+		}
 	}
+
+	DeepConsolidation consolidation(channels, _consolidate, _depth_tolerance, _alpha_error, _max_samples);
+
+	auto render = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
+	{
+		DeepScratch& band_scratch = threadScratch();
+		resizeScratch(band_scratch.footprint, max_taps[0] * max_taps[1], band_scratch.counters.allocations);
+		resizeScratch(band_scratch.weight, max_taps[0] * max_taps[1], band_scratch.counters.allocations);
+		size_t* footprint_pixels = &band_scratch.footprint[0];
+		float* weight = &band_scratch.weight[0];
+		DeepArenaSource source(arena);
+		source.pixels = footprint_pixels;
+
+		for (int y = y_begin; y < y_end; y++)
+		{
+			for (int x = box.x(); x < box.r(); x++)
+			{	
+				int column = x - columns->origin;
+				int row = y - rows->origin;
+				const float* footprint_weight = weight;
+				int amount = 0;
+
+				if (regular)
+				{
+					size_t base = arena.pixel(rows->position[rows->first[row]], columns->position[columns->first[column]]);
+					amount = regular_taps;
+
+					for (int k = 0; k < amount; k++)
+						footprint_pixels[k] = base + tap_offset[k];
+
+					footprint_weight = &tap_weight[0];
+				}
+
+				else
+				{
+					float weight_sum = 0;
+
+					for (int i = columns->first[column]; i < columns->first[column + 1]; i++)
+					{
+						for (int j = rows->first[row]; j < rows->first[row + 1]; j++)
+						{
+							footprint_pixels[amount] = arena.pixel(rows->position[j], columns->position[i]);
+							weight[amount] = columns->weight[i] * rows->weight[j];
+							weight_sum += weight[amount];
+
+							amount++;
+						}
+					}
+
+					//normalize weights, so their sum equals 1
+					if (weight_sum > 0)
+					{
+						weight_sum = 1 / weight_sum;
+						for (int i = 0; i < amount; i++)
+							weight[i] *= weight_sum;
+					}
+				}
+
+				DeepOutPixel& outPixel = *outPixels++;
+				outPixel.clear();
+				mergeDeepSamples(source, outPixel, channels, amount, footprint_weight, _drop_hidden, _drop_transparent, _threshold, _opacity_cutoff);
+				consolidateDeepSamples(outPixel, consolidation);
+			}
+		}
+	};
+
+	DeepTile tile;
+	renderDeepRows(box, _max_threads, render, outPlane, tile_cache.enabled() ? &tile : 0);
+	tile_cache.insert(hash(), box, channels, tile);
 	
 	return true;
 }
@@ -0,0 +1,154 @@
+/**
+msDeepTidy v1.0.0 (c) by Mark Spindler
+
+msDeepTidy is licensed under a Creative Commons Attribution 3.0 Unported License.
+
+To view a copy of this license, visit http://creativecommons.org/licenses/by/3.0/.
+**/
+
+
+static const char* const CLASS = "msDeepTidy";
+static const char* const HELP =	"Makes Deep images tidy: volumetric samples that overlap others get split at the fronts and backs of those, and samples that cover the same depth range get merged. "
+                                "Afterwards no two samples of a pixel overlap, while the flattened image stays the same.\n\n"
+                                "Tidying once upstream is cheaper than letting every subsequent Deep node deal with overlapping samples.\n\n"
+
+								"Version: 1.0.0\n"
+								"Author: Mark Spindler\n"
+								"Contact: info@mark-spindler.com";
+
+
+#include <numeric>
+#include <math.h>
+#include "DDImage/DeepOp.h"
+#include "DDImage/Iop.h"
+#include "DDImage/Knobs.h"
+#include "DDImage/RequestData.h"
+#include "msDeepFunctions.h"
+
+
+
+using namespace DD::Image;
+
+
+
+class msDeepTidy : public DeepOnlyOp
+{
+	private:
+		int _max_threads;
+		const char* _stats_text;
+		const char* _stats_file;
+
+		DeepStats stats;
+
+	public:
+		int minimum_inputs() const {return 1;}
+		int maximum_inputs() const {return 1;}
+
+		msDeepTidy(Node* node) : DeepOnlyOp(node)
+		{
+			_max_threads = 1;
+			_stats_text = 0;
+			_stats_file = 0;
+		}
+
+		virtual void knobs(Knob_Callback);
+		int knob_changed(Knob*);
+		bool test_input(int, Op*) const;
+		void _validate(bool);
+		void _close();
+		virtual void getDeepRequests(Box, const ChannelSet&, int, std::vector<RequestData>&);
+		virtual bool doDeepEngine(Box, const ChannelSet&, DeepOutputPlane&);
+
+		DeepOp* input0() {return dynamic_cast<DeepOp*>(Op::input(0));}
+
+		const char* Class() const {return CLASS;}
+		const char* node_help() const {return HELP;}
+		virtual Op* op() {return this;}
+		static const Iop::Description d;
+};
+
+
+void msDeepTidy::knobs(Knob_Callback f)
+{
+	Int_knob(f, &_max_threads, "max_threads", "max threads");
+	Tooltip(f, "Maximum number of threads that render the rows of a single requested box in parallel. 1, the default, renders each box on the thread that requested it, as Nuke already renders several boxes at once; more threads mostly help when only a few large boxes are requested, e.g. by a DeepWrite. 0 uses all cores. The result is the same for any number of threads.");
+
+	deepStatsKnobs(f, &_stats_text, &_stats_file);
+}
+
+
+int msDeepTidy::knob_changed(Knob* k)
+{
+	return deepStatsKnobChanged(this, k, stats, 0, _stats_file);
+}
+
+
+bool msDeepTidy::test_input(int, Op* op) const
+{
+	return dynamic_cast<DeepOp*>(op) != 0;
+}
+
+
+void msDeepTidy::_validate(bool for_real)
+{
+	if (input0())
+	{
+		input0()->validate(for_real);
+		_deepInfo = input0()->deepInfo();
+	}
+
+	else
+		_deepInfo = DeepInfo();
+}
+
+
+void msDeepTidy::_close()
+{
+	writeDeepStats(this, stats, 0, _stats_file);
+}
+
+
+void msDeepTidy::getDeepRequests(Box box, const ChannelSet& channels, int count, std::vector<RequestData>& requests)
+{
+	if (input0())
+		requests.push_back(RequestData(input0(), box, deepWorkingChannels(channels), count));
+}
+
+
+bool msDeepTidy::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+	if (!input0())
+		return false;
+
+	DeepPlane inPlane;
+
+	if (!input0()->deepEngine(box, deepWorkingChannels(channels), inPlane))
+		return false;
+
+	DeepStatsScope stats_scope(stats, channels);
+	stats_scope.read(inPlane);
+	outPlane = DeepOutputPlane(channels, box);
+
+	DeepTidyLayout layout(ChannelMap(inPlane.channels()), channels);
+
+	auto render = [&](int y_begin, int y_end, DeepOutPixel* outPixels)
+	{
+		for (int y = y_begin; y < y_end; y++)
+		{
+			for (int x = box.x(); x < box.r(); x++)
+			{
+				DeepOutPixel& outPixel = *outPixels++;
+				outPixel.clear();
+				makeDeepPixelTidy(inPlane.getPixel(y, x), outPixel, layout);
+			}
+		}
+	};
+
+	renderDeepRows(box, _max_threads, render, outPlane);
+
+	return true;
+}
+
+
+static Op* build(Node* node) {return new msDeepTidy(node);}
+const Op::Description msDeepTidy::d("msDeepTidy", 0, build);
\ No newline at end of file